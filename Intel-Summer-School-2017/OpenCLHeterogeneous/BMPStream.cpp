@@ -0,0 +1,101 @@
+#include "BMPStream.h"
+#include "imagefunctions.h"
+#include "errorcodes.h"
+#include <cstdint>
+
+BMPStripReader::BMPStripReader(const std::string &fileName)
+    : m_fileName(fileName),
+      m_stream(nullptr),
+      m_readRows(0)
+{
+    m_stream = fopen(fileName.c_str(), "rb");
+    if (m_stream == nullptr)
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not open " + fileName + "!").c_str());
+    if (fseeko(m_stream, 0, SEEK_END) != 0 || ftello(m_stream) <= 0)
+    {
+        fclose(m_stream);
+        throw cl::Error(INV_FILE_LENGTH, std::string("Cannot determine the length of file " + fileName).c_str());
+    }
+    uint64_t fileLength = static_cast<uint64_t>(ftello(m_stream));
+    rewind(m_stream);
+
+    BITMAPFILEHEADER_OWN fileHeader;
+    BITMAPINFOHEADER_OWN infoHeader;
+    if (fread(&fileHeader, sizeof(fileHeader), 1, m_stream) != 1 || fread(&infoHeader, sizeof(infoHeader), 1, m_stream) != 1)
+    {
+        fclose(m_stream);
+        throw cl::Error(CANNOT_READ_BMP, std::string("Could not read " + fileName + " BMP file.").c_str());
+    }
+    try
+    {
+        m_size = CheckBMPHeaders(fileHeader, infoHeader, fileLength, fileName);
+    }
+    catch (...)
+    {
+        fclose(m_stream);
+        throw;
+    }
+    // Strips are read in the file order right after the headers
+    if (fseeko(m_stream, fileHeader.bfOffBits, SEEK_SET) != 0)
+    {
+        fclose(m_stream);
+        throw cl::Error(CANNOT_READ_BMP, std::string("Could not read " + fileName + " BMP file.").c_str());
+    }
+}
+
+BMPStripReader::~BMPStripReader()
+{
+    if (m_stream != nullptr)
+        fclose(m_stream);
+}
+
+void BMPStripReader::readStrip(size_t rows, std::vector<unsigned char> &rgba)
+{
+    if (m_readRows + rows > static_cast<size_t>(m_size.s[1]))
+        throw cl::Error(CANNOT_READ_BMP, std::string("Strip is out of " + m_fileName + " BMP file.").c_str());
+    size_t pixelsCount = static_cast<size_t>(m_size.s[0]) * rows;
+    // Only size is changed, memory of the buffer is reused if it's large enough
+    rgba.resize(pixelsCount * 4);
+    if (pixelsCount != 0 && fread(&rgba[0], 4, pixelsCount, m_stream) != pixelsCount)
+        throw cl::Error(CANNOT_READ_BMP, std::string("Could not read " + m_fileName + " BMP file.").c_str());
+    // Pixels are converted in the same buffer, the file is read without extra copy
+    if (pixelsCount != 0)
+        ConvertBMPPixelsToRGBA(&rgba[0], &rgba[0], pixelsCount);
+    m_readRows += rows;
+}
+
+BMPStripWriter::BMPStripWriter(const std::string &fileName, int width, int height, size_t bytesPerPixel)
+    : m_fileName(fileName),
+      m_stream(nullptr),
+      m_width(width),
+      m_height(height),
+      m_bitCount(bytesPerPixel == 1 ? 8 : 24),
+      m_writtenRows(0)
+{
+    m_stream = CreateBMPFile(fileName, width, height, m_bitCount);
+}
+
+BMPStripWriter::~BMPStripWriter()
+{
+    if (m_stream != nullptr)
+        fclose(m_stream);
+}
+
+void BMPStripWriter::writeStrip(const unsigned char *pixels, size_t rows)
+{
+    if (m_stream == nullptr || m_writtenRows + rows > static_cast<size_t>(m_height))
+        throw cl::Error(CANNOT_WRITE_PIXEL_TO_FILE, std::string("Strip is out of " + m_fileName + " BMP file.").c_str());
+    if (!WriteBMPRows(m_stream, pixels, m_width, rows, m_bitCount))
+        throw cl::Error(CANNOT_WRITE_PIXEL_TO_FILE, std::string("Cannot write pixel to file!").c_str());
+    m_writtenRows += rows;
+}
+
+void BMPStripWriter::close()
+{
+    if (m_stream == nullptr)
+        return;
+    bool closed = fclose(m_stream) == 0;
+    m_stream = nullptr;
+    if (!closed || m_writtenRows != static_cast<size_t>(m_height))
+        throw cl::Error(CANNOT_WRITE_PIXEL_TO_FILE, std::string("Not all rows of " + m_fileName + " were written!").c_str());
+}
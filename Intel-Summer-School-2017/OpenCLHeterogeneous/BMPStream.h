@@ -0,0 +1,83 @@
+#ifndef BMPSTREAM_H
+#define BMPSTREAM_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+Reader of 32-bit BMP file by strips of rows.
+Only headers are read on opening, every strip is read from the file and
+converted to RGBA when it's requested, so an image of any size takes
+memory of one strip. Strips go in the same row order as pixels loaded by
+LoadImageAsBMP.
+*/
+class BMPStripReader
+{
+public:
+    /**
+    Open the file and validate its headers.
+
+    @param fileName BMP file, throws cl::Error if it can't be read.
+    */
+    explicit BMPStripReader(const std::string &fileName);
+    BMPStripReader(const BMPStripReader &) = delete;
+    BMPStripReader &operator=(const BMPStripReader &) = delete;
+    ~BMPStripReader();
+    inline cl_int2 getSize() const { return m_size; }
+    inline size_t getReadRows() const { return m_readRows; }
+    /**
+    Read the next strip of rows.
+
+    @param rows number of rows, the last strip can be shorter.
+    @param rgba RGBA pixels of the strip, capacity of the buffer is reused.
+    */
+    void readStrip(size_t rows, std::vector<unsigned char> &rgba);
+private:
+    std::string m_fileName;
+    FILE *m_stream;
+    cl_int2 m_size;
+    size_t m_readRows;
+};
+
+/**
+Writer of BMP file by strips of rows.
+Headers are written on creation and every strip is written as soon as
+it's passed, so results don't have to be kept for the whole image. RGBA
+pixels are written as 24-bit BMP and gray ones as 8-bit BMP, rows go in
+the same order as by SaveImageAsBMP.
+*/
+class BMPStripWriter
+{
+public:
+    /**
+    Create the file and write its headers.
+
+    @param bytesPerPixel 4 for RGBA pixels, 1 for gray ones.
+    */
+    BMPStripWriter(const std::string &fileName, int width, int height, size_t bytesPerPixel);
+    BMPStripWriter(const BMPStripWriter &) = delete;
+    BMPStripWriter &operator=(const BMPStripWriter &) = delete;
+    ~BMPStripWriter();
+    inline size_t getWrittenRows() const { return m_writtenRows; }
+    /**
+    Write the next strip of rows.
+
+    @param pixels pixels of the strip without row padding.
+    @param rows number of rows.
+    */
+    void writeStrip(const unsigned char *pixels, size_t rows);
+    // Close the file, throws cl::Error if not all rows were written or data can't be flushed
+    void close();
+private:
+    std::string m_fileName;
+    FILE *m_stream;
+    int m_width;
+    int m_height;
+    unsigned int m_bitCount;
+    size_t m_writtenRows;
+};
+
+#endif // BMPSTREAM_H
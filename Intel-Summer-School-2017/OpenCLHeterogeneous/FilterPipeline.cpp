@@ -0,0 +1,201 @@
+#include "FilterPipeline.h"
+#include "colorenum.h"
+#include "errorcodes.h"
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+
+FilterPipeline &FilterPipeline::grayscale()
+{
+    m_stages.push_back({ FilterStageType::Grayscale, 0, 0 });
+    return *this;
+}
+
+FilterPipeline &FilterPipeline::colorMask()
+{
+    m_stages.push_back({ FilterStageType::ColorMask, 0, 0 });
+    return *this;
+}
+
+FilterPipeline &FilterPipeline::threshold(cl_float level)
+{
+    m_stages.push_back({ FilterStageType::Threshold, level, 0 });
+    return *this;
+}
+
+FilterPipeline &FilterPipeline::gamma(cl_float gamma)
+{
+    m_stages.push_back({ FilterStageType::Gamma, gamma, 0 });
+    return *this;
+}
+
+FilterPipeline &FilterPipeline::brightnessContrast(cl_float brightness, cl_float contrast)
+{
+    m_stages.push_back({ FilterStageType::BrightnessContrast, brightness, contrast });
+    return *this;
+}
+
+FilterPipeline FilterPipeline::parse(const std::string &description)
+{
+    FilterPipeline pipeline;
+    std::istringstream stages(description);
+    std::string stage;
+    while (std::getline(stages, stage, ','))
+    {
+        auto separator = stage.find('=');
+        auto name = stage.substr(0, separator);
+        std::istringstream parameters(separator == std::string::npos ? "" : stage.substr(separator + 1));
+        cl_float first = 0;
+        cl_float second = 0;
+        char colon = 0;
+        if (name == "grayscale")
+            pipeline.grayscale();
+        else if (name == "mask")
+            pipeline.colorMask();
+        else if (name == "threshold" && parameters >> first)
+            pipeline.threshold(first);
+        else if (name == "gamma" && parameters >> first)
+            pipeline.gamma(first);
+        else if (name == "brightness_contrast" && parameters >> first >> colon >> second && colon == ':')
+            pipeline.brightnessContrast(first, second);
+        else
+            throw cl::Error(OCL_BAD_PIPELINE, std::string("Bad stage \"" + stage + "\" of filter pipeline!").c_str());
+    }
+    return pipeline;
+}
+
+std::string FilterPipeline::getSignature() const
+{
+    std::ostringstream signature;
+    for (auto &stage : m_stages)
+    {
+        switch (stage.type)
+        {
+        case FilterStageType::Grayscale:
+            signature << "grayscale;";
+            break;
+        case FilterStageType::ColorMask:
+            signature << "mask;";
+            break;
+        case FilterStageType::Threshold:
+            signature << "threshold(" << formatFloat(stage.first) << ");";
+            break;
+        case FilterStageType::Gamma:
+            signature << "gamma(" << formatFloat(stage.first) << ");";
+            break;
+        case FilterStageType::BrightnessContrast:
+            signature << "brightness_contrast(" << formatFloat(stage.first) << "," << formatFloat(stage.second) << ");";
+            break;
+        }
+    }
+    return signature.str();
+}
+
+std::string FilterPipeline::getKernelName() const
+{
+    // Name depends on the signature, so tuning data of different pipelines isn't mixed (32-bit FNV-1a hash)
+    uint32_t hash = 2166136261U;
+    for (auto c : getSignature())
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619U;
+    }
+    std::ostringstream name;
+    name << "filterPipeline_" << std::hex << std::setw(8) << std::setfill('0') << hash;
+    return name.str();
+}
+
+std::string FilterPipeline::generateSource() const
+{
+    auto kernelName = getKernelName();
+    std::ostringstream source;
+    source << "// Generated for pipeline: " << getSignature() << "\n"
+           << "enum ColorEnum { BW = " << BW << ", RED = " << RED << ", BLUE = " << BLUE << " };\n"
+           << "\n"
+           << "__constant sampler_t Sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST;\n"
+           << "\n"
+           << "#ifdef COLOR\n"
+           << "#define MASK_COLOR COLOR\n"
+           << "#else\n"
+           << "#define MASK_COLOR color\n"
+           << "#endif\n"
+           << "\n"
+           << "float4 applyStages(float4 p, int color)\n"
+           << "{\n"
+           << generateStages()
+           << "    p.w = 1.0f;\n"
+           << "    return clamp(p, 0.0f, 1.0f);\n"
+           << "}\n"
+           << "\n"
+           << "__kernel void " << kernelName << "(__read_only image2d_t inImage, __write_only image2d_t outImage, int color)\n"
+           << "{\n"
+           << "    int2 position = (int2)(get_global_id(0), get_global_id(1));\n"
+           << "    if (position.x >= get_image_width(outImage) || position.y >= get_image_height(outImage))\n"
+           << "        return;\n"
+           << "    write_imagef(outImage, position, applyStages(read_imagef(inImage, Sampler, position), color));\n"
+           << "}\n"
+           << "\n"
+           // Four pixels per work-item, the same as in maskToImageBuffer
+           << "__kernel void " << kernelName << "Buffer(__global const uchar *inImage, __global uchar *outImage, int color, int width, int rowPitch, int height)\n"
+           << "{\n"
+           << "    int x = get_global_id(0) * 4;\n"
+           << "    int y = get_global_id(1);\n"
+           << "    if (y >= height)\n"
+           << "        return;\n"
+           << "    size_t offset = ((size_t)y * rowPitch + x) * 4;\n"
+           << "    if (x + 4 <= width)\n"
+           << "    {\n"
+           << "        float16 pixels = convert_float16(vload16(0, inImage + offset)) * (1.0f / 255.0f);\n"
+           << "        pixels.s0123 = applyStages(pixels.s0123, color);\n"
+           << "        pixels.s4567 = applyStages(pixels.s4567, color);\n"
+           << "        pixels.s89ab = applyStages(pixels.s89ab, color);\n"
+           << "        pixels.scdef = applyStages(pixels.scdef, color);\n"
+           << "        vstore16(convert_uchar16_sat_rte(pixels * 255.0f), 0, outImage + offset);\n"
+           << "        return;\n"
+           << "    }\n"
+           << "    for (int i = x; i < width; ++i, offset += 4)\n"
+           << "    {\n"
+           << "        float4 pixel = convert_float4(vload4(0, inImage + offset)) * (1.0f / 255.0f);\n"
+           << "        vstore4(convert_uchar4_sat_rte(applyStages(pixel, color) * 255.0f), 0, outImage + offset);\n"
+           << "    }\n"
+           << "}\n";
+    return source.str();
+}
+
+std::string FilterPipeline::formatFloat(cl_float value)
+{
+    // Scientific notation keeps the value exact enough and is a valid float literal with "f" suffix
+    std::ostringstream str;
+    str << std::scientific << std::setprecision(8) << value;
+    return str.str();
+}
+
+std::string FilterPipeline::generateStages() const
+{
+    std::ostringstream stages;
+    for (auto &stage : m_stages)
+    {
+        switch (stage.type)
+        {
+        case FilterStageType::Grayscale:
+            stages << "    p.xyz = (float3)((p.x + p.y + p.z) / 3);\n";
+            break;
+        case FilterStageType::ColorMask:
+            stages << "    if (MASK_COLOR == RED)\n"
+                   << "        p.z = 1.0f;\n"
+                   << "    else if (MASK_COLOR != BW)\n"
+                   << "        p.x = 1.0f;\n";
+            break;
+        case FilterStageType::Threshold:
+            stages << "    p.xyz = step((float3)(" << formatFloat(stage.first) << "f), p.xyz);\n";
+            break;
+        case FilterStageType::Gamma:
+            stages << "    p.xyz = powr(max(p.xyz, 0.0f), (float3)(" << formatFloat(stage.first) << "f));\n";
+            break;
+        case FilterStageType::BrightnessContrast:
+            stages << "    p.xyz = (p.xyz - 0.5f) * " << formatFloat(stage.second) << "f + 0.5f + " << formatFloat(stage.first) << "f;\n";
+            break;
+        }
+    }
+    return stages.str();
+}
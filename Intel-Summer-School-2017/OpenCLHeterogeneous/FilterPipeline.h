@@ -0,0 +1,72 @@
+#ifndef FILTERPIPELINE_H
+#define FILTERPIPELINE_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <string>
+#include <vector>
+
+enum class FilterStageType {Grayscale, ColorMask, Threshold, Gamma, BrightnessContrast};
+
+/**
+Sequence of per-pixel filter stages.
+Stages are fused into one generated kernel which reads every pixel once,
+applies all stages to it in registers and writes it once. Parameters of
+stages are built into the source as constants, so the signature of the
+pipeline (stages and their parameters) identifies the generated program.
+Channels are processed as floats in range from 0.0 to 1.0.
+*/
+class FilterPipeline
+{
+public:
+    /**
+    Replace RGB channels by their average.
+    */
+    FilterPipeline &grayscale();
+    /**
+    Set mask of the device color (COLOR build option or color argument),
+    the same as maskToImage does after grayscale.
+    */
+    FilterPipeline &colorMask();
+    /**
+    Set every RGB channel to 0.0 if it's less than level, otherwise to 1.0.
+    */
+    FilterPipeline &threshold(cl_float level);
+    /**
+    Raise every RGB channel to the power of gamma.
+    */
+    FilterPipeline &gamma(cl_float gamma);
+    /**
+    Scale RGB channels around 0.5 by contrast and add brightness.
+    */
+    FilterPipeline &brightnessContrast(cl_float brightness, cl_float contrast);
+    /**
+    Create pipeline from comma separated list of stages, e.g.
+    "grayscale,mask,threshold=0.5,gamma=2.2,brightness_contrast=0.1:1.5".
+
+    @param description list of stages.
+    @return pipeline with the stages.
+    */
+    static FilterPipeline parse(const std::string &description);
+    inline bool isEmpty() const { return m_stages.empty(); }
+    std::string getSignature() const;
+    std::string getKernelName() const;
+    /**
+    Generate source of the fused kernels: image kernel with the name from
+    getKernelName and buffer kernel with "Buffer" suffix, both have the
+    same arguments as maskToImage and maskToImageBuffer.
+    */
+    std::string generateSource() const;
+private:
+    struct Stage
+    {
+        FilterStageType type;
+        cl_float first;
+        cl_float second;
+    };
+    static std::string formatFloat(cl_float value);
+    std::string generateStages() const;
+    std::vector<Stage> m_stages;
+};
+
+#endif // FILTERPIPELINE_H
@@ -0,0 +1,325 @@
+#include "HostImageEngine.h"
+#include "colorenum.h"
+#include <algorithm>
+#include <sstream>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HOST_SIMD_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+// Only these functions are compiled for SSE4.1 and AVX2, so the binary still runs on older processors
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Less pixels per task cost more for waking up of the worker than for the processing
+const size_t HOST_MIN_PIXELS_PER_TASK = 64 * 1024;
+// Fixed-point reciprocal of 3, the same as in maskToImageInt
+const uint32_t GRAY_MULTIPLIER = 21846;
+
+static void maskRowScalar(const unsigned char *src, unsigned char *dst, size_t width, uint32_t channel0, uint32_t channel2)
+{
+    for (size_t x = 0; x < width; ++x, src += 4, dst += 4)
+    {
+        uint32_t gray = ((src[0] + src[1] + src[2] + 1) * GRAY_MULTIPLIER) >> 16;
+        dst[0] = static_cast<unsigned char>(std::max(gray, channel0));
+        dst[1] = static_cast<unsigned char>(gray);
+        dst[2] = static_cast<unsigned char>(std::max(gray, channel2));
+        dst[3] = 255;
+    }
+}
+
+static void convertPixelsScalar(const unsigned char *src, unsigned char *dst, size_t pixelsCount)
+{
+    for (size_t i = 0; i < pixelsCount; ++i, src += 4, dst += 4)
+    {
+        // Pixel is read before it's written, so conversion can be done in place
+        unsigned char a = src[0];
+        dst[0] = src[1];
+        dst[1] = src[2];
+        dst[2] = src[3];
+        dst[3] = a;
+    }
+}
+
+static void packRowScalar(const unsigned char *src, unsigned char *dst, size_t width)
+{
+    for (size_t x = 0; x < width; ++x, src += 4, dst += 3)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+    }
+}
+
+#ifdef HOST_SIMD_X86
+// Pixels are processed as 32-bit lanes with R in the lowest byte
+TARGET_SSE41 static void maskRowSSE41(const unsigned char *src, unsigned char *dst, size_t width, uint32_t channel0, uint32_t channel2)
+{
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i multiplier = _mm_set1_epi32(GRAY_MULTIPLIER);
+    const __m128i mask0 = _mm_set1_epi32(channel0);
+    const __m128i mask2 = _mm_set1_epi32(channel2);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000));
+    size_t x = 0;
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 4));
+        __m128i r = _mm_and_si128(pixels, byteMask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask);
+        __m128i sum = _mm_add_epi32(_mm_add_epi32(r, g), _mm_add_epi32(b, one));
+        __m128i gray = _mm_srli_epi32(_mm_mullo_epi32(sum, multiplier), 16);
+        __m128i result = _mm_or_si128(_mm_or_si128(_mm_max_epu32(gray, mask0), _mm_slli_epi32(gray, 8)),
+                                      _mm_or_si128(_mm_slli_epi32(_mm_max_epu32(gray, mask2), 16), alpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 4), result);
+    }
+    maskRowScalar(src + x * 4, dst + x * 4, width - x, channel0, channel2);
+}
+
+TARGET_AVX2 static void maskRowAVX2(const unsigned char *src, unsigned char *dst, size_t width, uint32_t channel0, uint32_t channel2)
+{
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i multiplier = _mm256_set1_epi32(GRAY_MULTIPLIER);
+    const __m256i mask0 = _mm256_set1_epi32(channel0);
+    const __m256i mask2 = _mm256_set1_epi32(channel2);
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xFF000000));
+    size_t x = 0;
+    for (; x + 8 <= width; x += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4));
+        __m256i r = _mm256_and_si256(pixels, byteMask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), byteMask);
+        __m256i b = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), byteMask);
+        __m256i sum = _mm256_add_epi32(_mm256_add_epi32(r, g), _mm256_add_epi32(b, one));
+        __m256i gray = _mm256_srli_epi32(_mm256_mullo_epi32(sum, multiplier), 16);
+        __m256i result = _mm256_or_si256(_mm256_or_si256(_mm256_max_epu32(gray, mask0), _mm256_slli_epi32(gray, 8)),
+                                         _mm256_or_si256(_mm256_slli_epi32(_mm256_max_epu32(gray, mask2), 16), alpha));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 4), result);
+    }
+    maskRowScalar(src + x * 4, dst + x * 4, width - x, channel0, channel2);
+}
+
+// pshufb is SSSE3, which is a part of SSE4.1
+TARGET_SSE41 static void convertPixelsSSE41(const unsigned char *src, unsigned char *dst, size_t pixelsCount)
+{
+    const __m128i order = _mm_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    size_t i = 0;
+    for (; i + 4 <= pixelsCount; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * 4), _mm_shuffle_epi8(pixels, order));
+    }
+    convertPixelsScalar(src + i * 4, dst + i * 4, pixelsCount - i);
+}
+
+// Stores of 16 bytes carry 12 bytes of pixels, so the vector loop stops while they are inside of the row
+TARGET_SSE41 static void packRowSSE41(const unsigned char *src, unsigned char *dst, size_t width)
+{
+    const __m128i order = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    size_t x = 0;
+    for (; x + 6 <= width; x += 4)
+    {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 3), _mm_shuffle_epi8(pixels, order));
+    }
+    packRowScalar(src + x * 4, dst + x * 3, width - x);
+}
+
+TARGET_AVX2 static void packRowAVX2(const unsigned char *src, unsigned char *dst, size_t width)
+{
+    // Each 128-bit lane is packed to its low 12 bytes, then the lanes are joined to 24 bytes
+    const __m256i order = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                           0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t x = 0;
+    for (; x + 11 <= width; x += 8)
+    {
+        __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x * 4));
+        __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, order), lanes);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x * 3), packed);
+    }
+    packRowSSE41(src + x * 4, dst + x * 3, width - x);
+}
+
+TARGET_AVX2 static void convertPixelsAVX2(const unsigned char *src, unsigned char *dst, size_t pixelsCount)
+{
+    // Shuffle works inside of 128-bit lanes, so both lanes have the same order
+    const __m256i order = _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                           1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+    size_t i = 0;
+    for (; i + 16 <= pixelsCount; i += 16)
+    {
+        __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4));
+        __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i * 4 + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4), _mm256_shuffle_epi8(first, order));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i * 4 + 32), _mm256_shuffle_epi8(second, order));
+    }
+    convertPixelsSSE41(src + i * 4, dst + i * 4, pixelsCount - i);
+}
+#endif
+
+HostImageEngine::HostImageEngine()
+    : m_instructionSet(detectInstructionSet())
+{ }
+
+HostInstructionSet HostImageEngine::detectInstructionSet()
+{
+#if defined(HOST_SIMD_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    // AVX registers must be also saved by the OS
+    bool osAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+    __cpuidex(info, 7, 0);
+    bool avx2 = osAvx && (info[1] & (1 << 5)) != 0;
+    if (avx2)
+        return HostInstructionSet::AVX2;
+    if (sse41)
+        return HostInstructionSet::SSE41;
+#elif defined(HOST_SIMD_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return HostInstructionSet::AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return HostInstructionSet::SSE41;
+#endif
+    return HostInstructionSet::Scalar;
+}
+
+void HostImageEngine::setInstructionSet(HostInstructionSet instructionSet)
+{
+    m_instructionSet = std::min(instructionSet, detectInstructionSet());
+}
+
+std::string HostImageEngine::getDescription()
+{
+    const char *names[] = { "scalar", "SSE4.1", "AVX2" };
+    std::ostringstream description;
+    description << "Host (" << names[static_cast<int>(m_instructionSet)] << ", " << getThreadsCount() << " threads)";
+    return description.str();
+}
+
+void HostImageEngine::maskToImage(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t rowPitch, int color)
+{
+    uint32_t channel0 = (color == BLUE) ? 255 : 0;
+    uint32_t channel2 = (color == RED) ? 255 : 0;
+    size_t tasksCount = std::min(getThreadsCount(), std::max<size_t>(width * height / HOST_MIN_PIXELS_PER_TASK, 1));
+    if (tasksCount <= 1 || height <= 1)
+    {
+        maskRows(src, dst, width, height, rowPitch, channel0, channel2);
+        return;
+    }
+
+    size_t rowsPerTask = (height + tasksCount - 1) / tasksCount;
+    m_threadPool.run((height + rowsPerTask - 1) / rowsPerTask, [&](size_t task)
+    {
+        size_t row = task * rowsPerTask;
+        maskRows(src + row * rowPitch, dst + row * rowPitch, width, std::min(rowsPerTask, height - row), rowPitch, channel0, channel2);
+    });
+}
+
+void HostImageEngine::maskToImageReference(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t rowPitch, int color)
+{
+    uint32_t channel0 = (color == BLUE) ? 255 : 0;
+    uint32_t channel2 = (color == RED) ? 255 : 0;
+    for (size_t row = 0; row < height; ++row)
+        maskRowScalar(src + row * rowPitch, dst + row * rowPitch, width, channel0, channel2);
+}
+
+void HostImageEngine::convertABGRToRGBA(const unsigned char *src, unsigned char *dst, size_t pixelsCount)
+{
+    size_t tasksCount = std::min(getThreadsCount(), std::max<size_t>(pixelsCount / HOST_MIN_PIXELS_PER_TASK, 1));
+    if (tasksCount <= 1)
+    {
+        convertPixels(src, dst, pixelsCount);
+        return;
+    }
+
+    // Bands are multiples of 16 pixels, so only the last one has a scalar tail
+    size_t pixelsPerTask = ((pixelsCount + tasksCount - 1) / tasksCount + 15) & ~static_cast<size_t>(15);
+    m_threadPool.run((pixelsCount + pixelsPerTask - 1) / pixelsPerTask, [&](size_t task)
+    {
+        size_t first = task * pixelsPerTask;
+        convertPixels(src + first * 4, dst + first * 4, std::min(pixelsPerTask, pixelsCount - first));
+    });
+}
+
+void HostImageEngine::convertABGRToRGBAReference(const unsigned char *src, unsigned char *dst, size_t pixelsCount)
+{
+    convertPixelsScalar(src, dst, pixelsCount);
+}
+
+void HostImageEngine::packRowsTo24Bit(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t dstRowPitch)
+{
+    size_t tasksCount = std::min(getThreadsCount(), std::max<size_t>(width * height / HOST_MIN_PIXELS_PER_TASK, 1));
+    if (tasksCount <= 1 || height <= 1)
+    {
+        packRows(src, dst, width, height, dstRowPitch);
+        return;
+    }
+
+    size_t rowsPerTask = (height + tasksCount - 1) / tasksCount;
+    m_threadPool.run((height + rowsPerTask - 1) / rowsPerTask, [&](size_t task)
+    {
+        size_t row = task * rowsPerTask;
+        packRows(src + row * width * 4, dst + row * dstRowPitch, width, std::min(rowsPerTask, height - row), dstRowPitch);
+    });
+}
+
+void HostImageEngine::packRowsTo24BitReference(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t dstRowPitch)
+{
+    for (size_t row = 0; row < height; ++row, src += width * 4, dst += dstRowPitch)
+    {
+        packRowScalar(src, dst, width);
+        std::fill(dst + width * 3, dst + dstRowPitch, 0);
+    }
+}
+
+void HostImageEngine::packRows(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t dstRowPitch)
+{
+    auto packRow = packRowScalar;
+#ifdef HOST_SIMD_X86
+    if (m_instructionSet == HostInstructionSet::AVX2)
+        packRow = packRowAVX2;
+    else if (m_instructionSet == HostInstructionSet::SSE41)
+        packRow = packRowSSE41;
+#endif
+    for (size_t row = 0; row < height; ++row, src += width * 4, dst += dstRowPitch)
+    {
+        packRow(src, dst, width);
+        std::fill(dst + width * 3, dst + dstRowPitch, 0);
+    }
+}
+
+void HostImageEngine::convertPixels(const unsigned char *src, unsigned char *dst, size_t pixelsCount)
+{
+    auto convert = convertPixelsScalar;
+#ifdef HOST_SIMD_X86
+    if (m_instructionSet == HostInstructionSet::AVX2)
+        convert = convertPixelsAVX2;
+    else if (m_instructionSet == HostInstructionSet::SSE41)
+        convert = convertPixelsSSE41;
+#endif
+    convert(src, dst, pixelsCount);
+}
+
+void HostImageEngine::maskRows(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t rowPitch, uint32_t channel0, uint32_t channel2)
+{
+    auto maskRow = maskRowScalar;
+#ifdef HOST_SIMD_X86
+    if (m_instructionSet == HostInstructionSet::AVX2)
+        maskRow = maskRowAVX2;
+    else if (m_instructionSet == HostInstructionSet::SSE41)
+        maskRow = maskRowSSE41;
+#endif
+    for (size_t row = 0; row < height; ++row)
+        maskRow(src + row * rowPitch, dst + row * rowPitch, width, channel0, channel2);
+}
@@ -0,0 +1,80 @@
+#ifndef HOSTIMAGEENGINE_H
+#define HOSTIMAGEENGINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "ThreadPool.h"
+
+enum class HostInstructionSet {Scalar, SSE41, AVX2};
+
+/**
+Native host implementation of maskToImage.
+Rows are split between threads of the pool, every row is processed by SSE4.1 or
+AVX2 code chosen at runtime by support of the processor. Gray is
+computed in the same integer arithmetic as maskToImageInt, so all
+instruction sets give output bit-identical to maskToImageReference.
+*/
+class HostImageEngine
+{
+public:
+    HostImageEngine();
+    static HostInstructionSet detectInstructionSet();
+    /**
+    Limit instruction set, e.g. for comparison in benchmark. Instruction
+    set which isn't supported by the processor is replaced by the best
+    supported one.
+
+    @param instructionSet the best instruction set to use.
+    */
+    void setInstructionSet(HostInstructionSet instructionSet);
+    inline HostInstructionSet getInstructionSet() { return m_instructionSet; }
+    /**
+    Set number of threads.
+
+    @param threadsCount number of threads, 0 for number of hardware threads.
+    */
+    inline void setThreadsCount(size_t threadsCount) { m_threadPool.setThreadsCount(threadsCount); }
+    inline size_t getThreadsCount() { return m_threadPool.getThreadsCount(); }
+    std::string getDescription();
+    /**
+    Convert RGBA image to gray with mask of the color.
+
+    @param src input pixels.
+    @param dst output pixels, can't overlap with input.
+    @param rowPitch distance between rows of both images in bytes.
+    @param color value of ColorEnum.
+    */
+    void maskToImage(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t rowPitch, int color);
+    static void maskToImageReference(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t rowPitch, int color);
+    /**
+    Convert pixels of 32-bit BMP file (ABGR) to RGBA: every pixel is
+    rotated by one byte with byte shuffles, bands of pixels are converted
+    by threads of the pool.
+
+    @param src pixels of BMP file.
+    @param dst RGBA pixels, can be the same as input but can't overlap it partially.
+    @param pixelsCount number of pixels.
+    */
+    void convertABGRToRGBA(const unsigned char *src, unsigned char *dst, size_t pixelsCount);
+    static void convertABGRToRGBAReference(const unsigned char *src, unsigned char *dst, size_t pixelsCount);
+    /**
+    Pack rows of 32-bit pixels to rows of 24-bit BMP: the first three bytes
+    of every pixel are kept in the same order, the fourth one is dropped
+    and rows are padded with zeros. Rows are packed by threads of the pool.
+
+    @param src 32-bit pixels without row padding.
+    @param dst packed rows, can't overlap with input.
+    @param dstRowPitch distance between packed rows in bytes, at least 3 * width.
+    */
+    void packRowsTo24Bit(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t dstRowPitch);
+    static void packRowsTo24BitReference(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t dstRowPitch);
+private:
+    void packRows(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t dstRowPitch);
+    void convertPixels(const unsigned char *src, unsigned char *dst, size_t pixelsCount);
+    void maskRows(const unsigned char *src, unsigned char *dst, size_t width, size_t height, size_t rowPitch, uint32_t channel0, uint32_t channel2);
+    HostInstructionSet m_instructionSet;
+    ThreadPool m_threadPool;
+};
+
+#endif // HOSTIMAGEENGINE_H
@@ -0,0 +1,118 @@
+#include "ImagePool.h"
+#include <iterator>
+
+ImagePool::ImagePool()
+    : m_hits(0),
+      m_misses(0)
+{ }
+
+void ImagePool::setContext(cl::Context context)
+{
+    clear();
+    m_context = context;
+}
+
+cl::Image2D ImagePool::acquireImage(cl_mem_flags flags, const cl::ImageFormat &format, size_t width, size_t height)
+{
+    auto &images = m_images[ImageKey(flags, format.image_channel_order, format.image_channel_data_type, width, height)];
+    if (!images.empty())
+    {
+        ++m_hits;
+        auto image = images.back();
+        images.pop_back();
+        return image;
+    }
+    ++m_misses;
+    return cl::Image2D(m_context, flags, format, width, height);
+}
+
+void ImagePool::releaseImage(const cl::Image2D &image)
+{
+    auto flags = image.getInfo<CL_MEM_FLAGS>();
+    cl::ImageFormat format = image.getImageInfo<CL_IMAGE_FORMAT>();
+    auto width = image.getImageInfo<CL_IMAGE_WIDTH>();
+    auto height = image.getImageInfo<CL_IMAGE_HEIGHT>();
+    m_images[ImageKey(flags, format.image_channel_order, format.image_channel_data_type, width, height)].push_back(image);
+}
+
+cl::Buffer ImagePool::acquireBuffer(cl_mem_flags flags, size_t size)
+{
+    auto &buffers = m_buffers[std::make_pair(flags, size)];
+    if (!buffers.empty())
+    {
+        ++m_hits;
+        auto buffer = buffers.back();
+        buffers.pop_back();
+        return buffer;
+    }
+    ++m_misses;
+    return cl::Buffer(m_context, flags, size);
+}
+
+void ImagePool::releaseBuffer(const cl::Buffer &buffer)
+{
+    auto flags = buffer.getInfo<CL_MEM_FLAGS>();
+    auto size = buffer.getInfo<CL_MEM_SIZE>();
+    m_buffers[std::make_pair(flags, size)].push_back(buffer);
+}
+
+cl::Image2D ImagePool::acquireHostImage(cl_mem_flags flags, const cl::ImageFormat &format, size_t width, size_t height, size_t rowPitch, unsigned char *hostPtr)
+{
+    HostImageKey key(hostPtr, flags, format.image_channel_order, format.image_channel_data_type, width, height, rowPitch);
+    auto cached = m_hostImages.find(key);
+    if (cached != m_hostImages.end())
+    {
+        ++m_hits;
+        return cached->second;
+    }
+    ++m_misses;
+    cl::Image2D image(m_context, flags | CL_MEM_USE_HOST_PTR, format, width, height, rowPitch, hostPtr);
+    m_hostImages[key] = image;
+    return image;
+}
+
+cl::Buffer ImagePool::acquireHostBuffer(cl_mem_flags flags, size_t size, unsigned char *hostPtr)
+{
+    auto key = std::make_tuple(static_cast<const unsigned char *>(hostPtr), flags, size);
+    auto cached = m_hostBuffers.find(key);
+    if (cached != m_hostBuffers.end())
+    {
+        ++m_hits;
+        return cached->second;
+    }
+    ++m_misses;
+    cl::Buffer buffer(m_context, flags | CL_MEM_USE_HOST_PTR, size, hostPtr);
+    m_hostBuffers[key] = buffer;
+    return buffer;
+}
+
+void ImagePool::retainHostMemory(const std::vector<std::pair<const unsigned char *, const unsigned char *>> &ranges)
+{
+    auto isRetained = [&ranges](const unsigned char *hostPtr)
+    {
+        for (auto &range : ranges)
+        {
+            if (hostPtr >= range.first && hostPtr < range.second)
+                return true;
+        }
+        return false;
+    };
+    for (auto it = m_hostImages.begin(); it != m_hostImages.end();)
+        it = isRetained(std::get<0>(it->first)) ? std::next(it) : m_hostImages.erase(it);
+    for (auto it = m_hostBuffers.begin(); it != m_hostBuffers.end();)
+        it = isRetained(std::get<0>(it->first)) ? std::next(it) : m_hostBuffers.erase(it);
+}
+
+void ImagePool::releaseDeviceMemory()
+{
+    m_images.clear();
+    m_buffers.clear();
+}
+
+void ImagePool::clear()
+{
+    m_images.clear();
+    m_buffers.clear();
+    m_hostImages.clear();
+    m_hostBuffers.clear();
+}
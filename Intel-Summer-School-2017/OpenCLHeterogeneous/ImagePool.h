@@ -0,0 +1,57 @@
+#ifndef IMAGEPOOL_H
+#define IMAGEPOOL_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <map>
+#include <tuple>
+#include <vector>
+
+/**
+Pool of device images and buffers.
+Memory objects are created on the first request of a given format and
+size and then reused, so in steady state tiles are processed without any
+allocations in the driver. Objects over host memory (CL_MEM_USE_HOST_PTR)
+of zero-copy mode are cached by host pointer and shape instead: a tile
+gets the same object every time it comes to the same host buffer.
+*/
+class ImagePool
+{
+public:
+    ImagePool();
+    void setContext(cl::Context context);
+    cl::Image2D acquireImage(cl_mem_flags flags, const cl::ImageFormat &format, size_t width, size_t height);
+    void releaseImage(const cl::Image2D &image);
+    cl::Buffer acquireBuffer(cl_mem_flags flags, size_t size);
+    void releaseBuffer(const cl::Buffer &buffer);
+    cl::Image2D acquireHostImage(cl_mem_flags flags, const cl::ImageFormat &format, size_t width, size_t height, size_t rowPitch, unsigned char *hostPtr);
+    cl::Buffer acquireHostBuffer(cl_mem_flags flags, size_t size, unsigned char *hostPtr);
+    /**
+    Drop objects over host memory which is out of the given ranges, e.g.
+    over buffers of images which aren't processed anymore.
+
+    @param ranges begin and end of host buffers which are still in use.
+    */
+    void retainHostMemory(const std::vector<std::pair<const unsigned char *, const unsigned char *>> &ranges);
+    // Drop free device objects, e.g. when tiles of a new image size won't match them anymore
+    void releaseDeviceMemory();
+    void clear();
+    inline size_t getHits() { return m_hits; }
+    inline size_t getMisses() { return m_misses; }
+private:
+    // flags, channel order, channel data type, width, height
+    typedef std::tuple<cl_mem_flags, cl_channel_order, cl_channel_type, size_t, size_t> ImageKey;
+    cl::Context m_context;
+    std::map<ImageKey, std::vector<cl::Image2D>> m_images;
+    // flags, size in bytes
+    std::map<std::pair<cl_mem_flags, size_t>, std::vector<cl::Buffer>> m_buffers;
+    // host pointer, flags, channel order, channel data type, width, height, row pitch
+    typedef std::tuple<const unsigned char *, cl_mem_flags, cl_channel_order, cl_channel_type, size_t, size_t, size_t> HostImageKey;
+    std::map<HostImageKey, cl::Image2D> m_hostImages;
+    // host pointer, flags, size in bytes
+    std::map<std::tuple<const unsigned char *, cl_mem_flags, size_t>, cl::Buffer> m_hostBuffers;
+    size_t m_hits;
+    size_t m_misses;
+};
+
+#endif // IMAGEPOOL_H
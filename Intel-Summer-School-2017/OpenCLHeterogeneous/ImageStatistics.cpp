@@ -0,0 +1,96 @@
+#include "ImageStatistics.h"
+#include <algorithm>
+#include <iostream>
+
+// Offsets in device buffer, should be the same as STATISTICS_*_OFFSET in OpenCLImages.cl
+const size_t STATISTICS_MIN_OFFSET = ImageStatistics::CHANNELS_COUNT * ImageStatistics::HISTOGRAM_BINS;
+const size_t STATISTICS_MAX_OFFSET = STATISTICS_MIN_OFFSET + ImageStatistics::CHANNELS_COUNT;
+// Sums are stored as pairs of low and high 32-bit parts
+const size_t STATISTICS_SUM_OFFSET = STATISTICS_MAX_OFFSET + ImageStatistics::CHANNELS_COUNT;
+const size_t STATISTICS_SQUARES_OFFSET = STATISTICS_SUM_OFFSET + 2 * ImageStatistics::CHANNELS_COUNT;
+const size_t STATISTICS_SIZE = STATISTICS_SQUARES_OFFSET + 2 * ImageStatistics::CHANNELS_COUNT;
+
+const size_t ImageStatistics::HISTOGRAM_BINS;
+
+ImageStatistics::ImageStatistics()
+    : m_pixelsCount(0)
+{
+    for (size_t channel = 0; channel < CHANNELS_COUNT; ++channel)
+    {
+        m_histograms[channel].resize(HISTOGRAM_BINS, 0);
+        m_min[channel] = 0xFFFFFFFF;
+        m_max[channel] = 0;
+        m_sum[channel] = 0;
+        m_sumOfSquares[channel] = 0;
+    }
+}
+
+std::vector<cl_uint> ImageStatistics::getDeviceInitialValues()
+{
+    std::vector<cl_uint> values(STATISTICS_SIZE, 0);
+    std::fill(values.begin() + STATISTICS_MIN_OFFSET, values.begin() + STATISTICS_MAX_OFFSET, 0xFFFFFFFF);
+    return values;
+}
+
+size_t ImageStatistics::getDeviceSize()
+{
+    return STATISTICS_SIZE;
+}
+
+void ImageStatistics::merge(const std::vector<cl_uint> &deviceValues)
+{
+    cl_ulong devicePixels = 0;
+    for (size_t bin = 0; bin < HISTOGRAM_BINS; ++bin)
+        devicePixels += deviceValues[bin];
+    // Device without pixels has initial values only
+    if (devicePixels == 0)
+        return;
+    m_pixelsCount += devicePixels;
+
+    for (size_t channel = 0; channel < CHANNELS_COUNT; ++channel)
+    {
+        for (size_t bin = 0; bin < HISTOGRAM_BINS; ++bin)
+            m_histograms[channel][bin] += deviceValues[channel * HISTOGRAM_BINS + bin];
+        m_min[channel] = std::min(m_min[channel], deviceValues[STATISTICS_MIN_OFFSET + channel]);
+        m_max[channel] = std::max(m_max[channel], deviceValues[STATISTICS_MAX_OFFSET + channel]);
+        m_sum[channel] += deviceValues[STATISTICS_SUM_OFFSET + 2 * channel] + ((cl_ulong)deviceValues[STATISTICS_SUM_OFFSET + 2 * channel + 1] << 32);
+        m_sumOfSquares[channel] += deviceValues[STATISTICS_SQUARES_OFFSET + 2 * channel] + ((cl_ulong)deviceValues[STATISTICS_SQUARES_OFFSET + 2 * channel + 1] << 32);
+    }
+}
+
+cl_double ImageStatistics::getMean(Channel channel) const
+{
+    return m_pixelsCount == 0 ? 0 : (cl_double)m_sum[channel] / m_pixelsCount;
+}
+
+cl_double ImageStatistics::getVariance(Channel channel) const
+{
+    if (m_pixelsCount == 0)
+        return 0;
+    cl_double mean = getMean(channel);
+    return (cl_double)m_sumOfSquares[channel] / m_pixelsCount - mean * mean;
+}
+
+cl_uint ImageStatistics::getPercentile(Channel channel, cl_double fraction) const
+{
+    cl_ulong count = 0;
+    for (size_t bin = 0; bin < HISTOGRAM_BINS; ++bin)
+    {
+        count += m_histograms[channel][bin];
+        if (count >= fraction * m_pixelsCount)
+            return bin;
+    }
+    return HISTOGRAM_BINS - 1;
+}
+
+void ImageStatistics::print() const
+{
+    const char *names[] = { "R", "G", "B", "Luma" };
+    std::cout << "Statistics of " << m_pixelsCount << " pixels:" << std::endl;
+    for (size_t channel = 0; channel < CHANNELS_COUNT; ++channel)
+    {
+        auto c = static_cast<Channel>(channel);
+        std::cout << "    " << names[channel] << ": min " << getMin(c) << ", max " << getMax(c) << ", mean " << getMean(c)
+                  << ", variance " << getVariance(c) << ", 1%-99% " << getPercentile(c, 0.01) << "-" << getPercentile(c, 0.99) << std::endl;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef IMAGESTATISTICS_H
+#define IMAGESTATISTICS_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <vector>
+
+/**
+Histograms, minimums, maximums, sums and sums of squares of R, G, B
+channels and luma of an image.
+Every device accumulates statistics of its tiles in a small buffer of
+getDeviceSize values, which is read back once and merged here, so the
+image itself isn't read back. Luma is integer BT.601:
+(77 * R + 150 * G + 29 * B) / 256.
+*/
+class ImageStatistics
+{
+public:
+    enum Channel {RED_CHANNEL, GREEN_CHANNEL, BLUE_CHANNEL, LUMA_CHANNEL, CHANNELS_COUNT};
+    static const size_t HISTOGRAM_BINS = 256;
+
+    ImageStatistics();
+    /**
+    Values of device buffer before the first tile.
+    Layout is the same as in imageStatistics kernel.
+    */
+    static std::vector<cl_uint> getDeviceInitialValues();
+    static size_t getDeviceSize();
+    void merge(const std::vector<cl_uint> &deviceValues);
+    inline const std::vector<cl_uint> &getHistogram(Channel channel) const { return m_histograms[channel]; }
+    inline cl_uint getMin(Channel channel) const { return m_min[channel]; }
+    inline cl_uint getMax(Channel channel) const { return m_max[channel]; }
+    inline cl_ulong getSum(Channel channel) const { return m_sum[channel]; }
+    inline cl_ulong getSumOfSquares(Channel channel) const { return m_sumOfSquares[channel]; }
+    inline cl_ulong getPixelsCount() const { return m_pixelsCount; }
+    cl_double getMean(Channel channel) const;
+    cl_double getVariance(Channel channel) const;
+    /**
+    Get value below which the given part of pixels lies, e.g. for
+    auto-levels or threshold.
+
+    @param fraction part of pixels from 0.0 to 1.0.
+    @return value of channel from 0 to 255.
+    */
+    cl_uint getPercentile(Channel channel, cl_double fraction) const;
+    void print() const;
+private:
+    std::vector<cl_uint> m_histograms[CHANNELS_COUNT];
+    cl_uint m_min[CHANNELS_COUNT];
+    cl_uint m_max[CHANNELS_COUNT];
+    cl_ulong m_sum[CHANNELS_COUNT];
+    cl_ulong m_sumOfSquares[CHANNELS_COUNT];
+    cl_ulong m_pixelsCount;
+};
+
+#endif // IMAGESTATISTICS_H
@@ -0,0 +1,152 @@
+#include "LocalSizeTuner.h"
+#include "errorcodes.h"
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+// Number of measured launches of every candidate after a warm-up one
+const int LOCAL_SIZE_MEASURE_RUNS = 3;
+
+LocalSizeTuner::LocalSizeTuner()
+    : m_tunedCount(0)
+{ }
+
+void LocalSizeTuner::setFile(std::string fileName)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fileName = fileName;
+    m_localSizes.clear();
+    if (isEnabled())
+        load();
+}
+
+std::pair<size_t, size_t> LocalSizeTuner::getLocalSize(const cl::CommandQueue &queue, cl::Kernel &kernel, size_t globalWidth, size_t globalHeight, const std::vector<cl::Event> *waitList)
+{
+    auto device = queue.getInfo<CL_QUEUE_DEVICE>();
+    // Sizes are bucketed, so tiles of the adaptive split with slightly different heights share one tuned size
+    TuningKey key(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), device.getInfo<CL_DEVICE_NAME>() + " " + device.getInfo<CL_DRIVER_VERSION>(),
+                  getSizeBucket(globalWidth), getSizeBucket(globalHeight));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto tuned = m_localSizes.find(key);
+        if (tuned != m_localSizes.end())
+            return tuned->second;
+    }
+
+    // Input of the kernel has to be ready before measurement
+    if (waitList != nullptr && !waitList->empty())
+        cl::Event::waitForEvents(*waitList);
+
+    // Choice of driver is measured too, so the tuned size is never worse than it
+    std::pair<size_t, size_t> bestSize(0, 0);
+    cl_double bestTime = measure(queue, kernel, globalWidth, globalHeight, bestSize);
+    for (auto &candidate : getCandidates(kernel, device))
+    {
+        // Local size larger than the global one only adds idle work-items
+        if (candidate.first > globalWidth || candidate.second > globalHeight)
+            continue;
+        try
+        {
+            cl_double time = measure(queue, kernel, globalWidth, globalHeight, candidate);
+            if (time < bestTime)
+            {
+                bestTime = time;
+                bestSize = candidate;
+            }
+        }
+        catch (cl::Error &)
+        {
+            // Local size is rejected for this kernel (e.g. because of private memory usage)
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_localSizes[key] = bestSize;
+    ++m_tunedCount;
+    append(key, bestSize);
+    return bestSize;
+}
+
+size_t LocalSizeTuner::getSizeBucket(size_t size)
+{
+    size_t bucket = 1;
+    while (bucket < size)
+        bucket *= 2;
+    return bucket;
+}
+
+size_t LocalSizeTuner::padGlobalSize(size_t globalSize, size_t localSize)
+{
+    if (localSize == 0)
+        return globalSize;
+    return (globalSize + localSize - 1) / localSize * localSize;
+}
+
+std::vector<std::pair<size_t, size_t>> LocalSizeTuner::getCandidates(const cl::Kernel &kernel, const cl::Device &device)
+{
+    auto maxSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    auto multiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    auto maxItemSizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    if (multiple == 0 || multiple > maxSize)
+        multiple = 1;
+
+    // Sides are powers of two, work-group size is a multiple of the preferred one
+    std::vector<std::pair<size_t, size_t>> candidates;
+    for (size_t width = 1; width <= maxSize && width <= maxItemSizes[0]; width *= 2)
+    {
+        for (size_t height = 1; width * height <= maxSize && height <= maxItemSizes[1]; height *= 2)
+        {
+            if ((width * height) % multiple == 0)
+                candidates.push_back(std::make_pair(width, height));
+        }
+    }
+    return candidates;
+}
+
+cl_double LocalSizeTuner::measure(const cl::CommandQueue &queue, cl::Kernel &kernel, size_t globalWidth, size_t globalHeight, std::pair<size_t, size_t> localSize)
+{
+    cl::NDRange globalRange(padGlobalSize(globalWidth, localSize.first), padGlobalSize(globalHeight, localSize.second));
+    cl::NDRange localRange = (localSize.first == 0) ? cl::NullRange : cl::NDRange(localSize.first, localSize.second);
+    // The first launch is a warm-up
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, localRange);
+    queue.finish();
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < LOCAL_SIZE_MEASURE_RUNS; ++i)
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, localRange);
+    queue.finish();
+    auto endTime = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<cl_double, std::milli>(endTime - startTime).count();
+}
+
+void LocalSizeTuner::load()
+{
+    // Every line is: kernel global_width global_height local_width local_height device
+    std::ifstream tuningFile(m_fileName);
+    std::string line;
+    while (std::getline(tuningFile, line))
+    {
+        std::istringstream entry(line);
+        std::string kernelName;
+        std::string deviceName;
+        size_t globalWidth = 0;
+        size_t globalHeight = 0;
+        std::pair<size_t, size_t> localSize;
+        entry >> kernelName >> globalWidth >> globalHeight >> localSize.first >> localSize.second >> std::ws;
+        std::getline(entry, deviceName);
+        if (entry.fail() || deviceName.empty())
+            continue;
+        // Entries of older files with exact sizes are moved to their buckets
+        m_localSizes[TuningKey(kernelName, deviceName, getSizeBucket(globalWidth), getSizeBucket(globalHeight))] = localSize;
+    }
+}
+
+void LocalSizeTuner::append(const TuningKey &key, std::pair<size_t, size_t> localSize)
+{
+    // Only the new entry is written, later lines of the same key override earlier ones on load
+    std::ofstream tuningFile(m_fileName, std::ios::app);
+    if (!tuningFile.is_open())
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Cannot open " + m_fileName + " with writing access!").c_str());
+
+    tuningFile << std::get<0>(key) << " " << std::get<2>(key) << " " << std::get<3>(key) << " "
+               << localSize.first << " " << localSize.second << " " << std::get<1>(key) << std::endl;
+}
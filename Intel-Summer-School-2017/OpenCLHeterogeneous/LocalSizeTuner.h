@@ -0,0 +1,60 @@
+#ifndef LOCALSIZETUNER_H
+#define LOCALSIZETUNER_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+Tuner of local work size of 2D kernels.
+On the first launch of a kernel on a device with a global size in a
+new bucket (width and height rounded up to powers of two) all 2D local
+sizes which fit to CL_KERNEL_WORK_GROUP_SIZE and are multiples of
+CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE are measured
+together with the choice of driver, and the fastest one is appended to
+a tuning file. Later runs load the file and don't measure again.
+Global size is padded to a multiple of the local size, so kernels have
+to check bounds.
+*/
+class LocalSizeTuner
+{
+public:
+    LocalSizeTuner();
+    /**
+    Set tuning file and load local sizes tuned by previous runs.
+
+    @param fileName file with tuned local sizes, empty string disables tuning.
+    */
+    void setFile(std::string fileName);
+    inline bool isEnabled() { return !m_fileName.empty(); }
+    /**
+    Get local size for the kernel, measure it if it's not tuned yet.
+    Arguments of the kernel have to be set and commands in wait list
+    are waited before measurement.
+
+    @return local width and height, zeros mean the choice of driver.
+    */
+    std::pair<size_t, size_t> getLocalSize(const cl::CommandQueue &queue, cl::Kernel &kernel, size_t globalWidth, size_t globalHeight, const std::vector<cl::Event> *waitList);
+    inline size_t getTunedCount() { return m_tunedCount; }
+    static size_t padGlobalSize(size_t globalSize, size_t localSize);
+private:
+    // kernel name, device name and driver version, global width and height rounded up to powers of two
+    typedef std::tuple<std::string, std::string, size_t, size_t> TuningKey;
+    std::vector<std::pair<size_t, size_t>> getCandidates(const cl::Kernel &kernel, const cl::Device &device);
+    cl_double measure(const cl::CommandQueue &queue, cl::Kernel &kernel, size_t globalWidth, size_t globalHeight, std::pair<size_t, size_t> localSize);
+    static size_t getSizeBucket(size_t size);
+    void load();
+    void append(const TuningKey &key, std::pair<size_t, size_t> localSize);
+    std::string m_fileName;
+    std::map<TuningKey, std::pair<size_t, size_t>> m_localSizes;
+    size_t m_tunedCount;
+    // Devices of dynamic scheduling launch kernels from their own threads
+    std::mutex m_mutex;
+};
+
+#endif // LOCALSIZETUNER_H
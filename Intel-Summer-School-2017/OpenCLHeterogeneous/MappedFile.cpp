@@ -0,0 +1,98 @@
+#include "MappedFile.h"
+#include "errorcodes.h"
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile()
+    : m_data(nullptr),
+      m_size(0),
+      m_writable(false)
+{ }
+
+MappedFile::MappedFile(const std::string &fileName)
+    : MappedFile()
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not open " + fileName + "!").c_str());
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0)
+    {
+        close(fd);
+        throw cl::Error(INV_FILE_LENGTH, std::string("Cannot determine the length of file " + fileName).c_str());
+    }
+    m_size = static_cast<size_t>(fileStat.st_size);
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // Mapping keeps its own reference to the file
+    close(fd);
+    if (data == MAP_FAILED)
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not map " + fileName + " to memory!").c_str());
+    // File is read once from the beginning to the end
+    madvise(data, m_size, MADV_SEQUENTIAL);
+    m_data = static_cast<unsigned char *>(data);
+}
+
+MappedFile MappedFile::create(const std::string &fileName, size_t size)
+{
+    int fd = open(fileName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Cannot open " + fileName + " with writing access!").c_str());
+    // File gets its final size at once, pages are allocated when they are written
+    if (size == 0 || ftruncate(fd, static_cast<off_t>(size)) != 0)
+    {
+        close(fd);
+        throw cl::Error(INV_FILE_LENGTH, std::string("Cannot set the length of file " + fileName).c_str());
+    }
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not map " + fileName + " to memory!").c_str());
+    MappedFile file;
+    file.m_data = static_cast<unsigned char *>(data);
+    file.m_size = size;
+    file.m_writable = true;
+    return file;
+}
+
+MappedFile::MappedFile(MappedFile &&other)
+    : m_data(other.m_data),
+      m_size(other.m_size),
+      m_writable(other.m_writable)
+{
+    other.m_data = nullptr;
+    other.m_size = 0;
+    other.m_writable = false;
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other)
+{
+    if (this != &other)
+    {
+        unmap();
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_writable = other.m_writable;
+        other.m_data = nullptr;
+        other.m_size = 0;
+        other.m_writable = false;
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+void MappedFile::unmap()
+{
+    if (m_data != nullptr)
+        munmap(m_data, m_size);
+    m_data = nullptr;
+    m_size = 0;
+    m_writable = false;
+}
@@ -0,0 +1,48 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+/**
+File mapped to memory.
+Pages are loaded by the OS on access and aren't copied to process heap,
+so a file of any size takes no memory of its own. Mapping is moved, not
+copied, and unmapped in destructor. Existing files are mapped read-only,
+created ones can be written through the mapping.
+*/
+class MappedFile
+{
+public:
+    MappedFile();
+    /**
+    Map the whole file.
+
+    @param fileName file to map, throws cl::Error if it can't be opened or is empty.
+    */
+    explicit MappedFile(const std::string &fileName);
+    /**
+    Create file of the given size, or truncate existing one, and map it
+    for writing. Data written to the mapping goes to the file.
+
+    @param fileName file to create, throws cl::Error if it can't be created.
+    @param size size of the file in bytes, has to be positive.
+    */
+    static MappedFile create(const std::string &fileName, size_t size);
+    MappedFile(MappedFile &&other);
+    MappedFile &operator=(MappedFile &&other);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+    inline const unsigned char *getData() const { return m_data; }
+    inline size_t getSize() const { return m_size; }
+    // Data of created file, nullptr for read-only mapping
+    inline unsigned char *getWritableData() { return m_writable ? m_data : nullptr; }
+private:
+    void unmap();
+    unsigned char *m_data;
+    size_t m_size;
+    bool m_writable;
+};
+
+#endif // MAPPEDFILE_H
@@ -2,21 +2,312 @@
 
 __constant sampler_t Sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_FILTER_NEAREST;
 
+// Color of mask can be fixed at build time by -DCOLOR=<ColorEnum value>,
+// then the color argument is ignored and branches on it are folded by compiler
+#ifdef COLOR
+#define MASK_COLOR COLOR
+#else
+#define MASK_COLOR color
+#endif
+
 __kernel void maskToImage(__read_only image2d_t inImage, __write_only image2d_t outImage, int color)
 {
     // Gray = (R + G + B) / 3;
     int2 position = (int2)(get_global_id(0), get_global_id(1));
+    // Global size can be padded to a multiple of local size
+    if (position.x >= get_image_width(outImage) || position.y >= get_image_height(outImage))
+        return;
     float4 currentPixel = (float4)(0, 0, 0, 0);
 
     currentPixel = read_imagef(inImage, Sampler, position);
     float *rgba = (float*)&currentPixel;
     float gray = (rgba[0] + rgba[1] + rgba[2]) / 3;
     float4 bwPixel;
-    if (color == BW)
+    if (MASK_COLOR == BW)
         bwPixel = (float4)(gray, gray, gray, 255);
-    else if (color == RED)
+    else if (MASK_COLOR == RED)
         bwPixel = (float4)(gray, gray, 255, 255);
     else
         bwPixel = (float4)(255, gray, gray, 255);
     write_imagef(outImage, position, bwPixel);
 }
+
+// Number of pixels in a row which are processed by one work-item of maskToImageInt,
+// host code uses the same value for global size
+#define PIXELS_PER_WORK_ITEM 4
+
+__kernel void maskToImageInt(__read_only image2d_t inImage, __write_only image2d_t outImage, int color)
+{
+    // Gray = (R + G + B) / 3 rounded to nearest, (x * 21846) >> 16 is exact floor(x / 3) for x <= 766
+    int x = get_global_id(0) * PIXELS_PER_WORK_ITEM;
+    int y = get_global_id(1);
+    int width = get_image_width(inImage);
+    // Global size can be padded to a multiple of local size
+    if (y >= get_image_height(inImage))
+        return;
+    uint redChannel = (MASK_COLOR == BLUE) ? 255 : 0;
+    uint blueChannel = (MASK_COLOR == RED) ? 255 : 0;
+
+    for (int i = 0; i < PIXELS_PER_WORK_ITEM; ++i)
+    {
+        int2 position = (int2)(x + i, y);
+        if (position.x < width)
+        {
+            uint4 currentPixel = read_imageui(inImage, Sampler, position);
+            uint gray = ((currentPixel.x + currentPixel.y + currentPixel.z + 1) * 21846) >> 16;
+            uint4 maskPixel = (uint4)(max(gray, redChannel), gray, max(gray, blueChannel), 255);
+            write_imageui(outImage, position, maskPixel);
+        }
+    }
+}
+
+// Number of pixels processed by one work-item of maskToImageBuffer, 16 bytes are loaded by one vload16,
+// host code uses the same value for global size
+#define BUFFER_PIXELS_PER_WORK_ITEM 4
+
+__kernel void maskToImageBuffer(__global const uchar *inImage, __global uchar *outImage, int color, int width, int rowPitch, int height)
+{
+    // Pixels are RGBA, rowPitch is distance between rows in pixels
+    int x = get_global_id(0) * BUFFER_PIXELS_PER_WORK_ITEM;
+    int y = get_global_id(1);
+    // Global size can be padded to a multiple of local size
+    if (y >= height)
+        return;
+    size_t offset = ((size_t)y * rowPitch + x) * 4;
+    uint redChannel = (MASK_COLOR == BLUE) ? 255 : 0;
+    uint blueChannel = (MASK_COLOR == RED) ? 255 : 0;
+
+    if (x + BUFFER_PIXELS_PER_WORK_ITEM <= width)
+    {
+        // Gray is computed for four pixels at once in the same fixed-point arithmetic as in maskToImageInt
+        uint16 pixels = convert_uint16(vload16(0, inImage + offset));
+        uint4 gray = ((pixels.s048c + pixels.s159d + pixels.s26ae + 1) * 21846) >> 16;
+        uint16 maskPixels;
+        maskPixels.s048c = max(gray, redChannel);
+        maskPixels.s159d = gray;
+        maskPixels.s26ae = max(gray, blueChannel);
+        maskPixels.s37bf = 255;
+        vstore16(convert_uchar16(maskPixels), 0, outImage + offset);
+        return;
+    }
+
+    // Tail of the row which is shorter than vector
+    for (int i = x; i < width; ++i, offset += 4)
+    {
+        uint4 currentPixel = convert_uint4(vload4(0, inImage + offset));
+        uint gray = ((currentPixel.x + currentPixel.y + currentPixel.z + 1) * 21846) >> 16;
+        uint4 maskPixel = (uint4)(max(gray, redChannel), gray, max(gray, blueChannel), 255);
+        vstore4(convert_uchar4(maskPixel), 0, outImage + offset);
+    }
+}
+
+// BW result of maskToImage has three equal channels, so only gray is written:
+// to CL_R image or to packed uchar buffer, 1 byte per pixel instead of 4.
+// Arguments are the same as of maskToImage and maskToImageBuffer, color is ignored
+__kernel void maskToGray(__read_only image2d_t inImage, __write_only image2d_t outImage, int color)
+{
+    int2 position = (int2)(get_global_id(0), get_global_id(1));
+    // Global size can be padded to a multiple of local size
+    if (position.x >= get_image_width(outImage) || position.y >= get_image_height(outImage))
+        return;
+    uint4 currentPixel = convert_uint4_sat_rte(read_imagef(inImage, Sampler, position) * 255.0f);
+    uint gray = ((currentPixel.x + currentPixel.y + currentPixel.z + 1) * 21846) >> 16;
+    write_imagef(outImage, position, (float4)(gray / 255.0f, 0, 0, 1));
+}
+
+__kernel void maskToGrayBuffer(__global const uchar *inImage, __global uchar *outImage, int color, int width, int rowPitch, int height)
+{
+    // Input pixels are RGBA, output pixels are gray, rowPitch is distance between rows in pixels in both
+    int x = get_global_id(0) * BUFFER_PIXELS_PER_WORK_ITEM;
+    int y = get_global_id(1);
+    // Global size can be padded to a multiple of local size
+    if (y >= height)
+        return;
+    size_t offset = (size_t)y * rowPitch + x;
+
+    if (x + BUFFER_PIXELS_PER_WORK_ITEM <= width)
+    {
+        uint16 pixels = convert_uint16(vload16(0, inImage + offset * 4));
+        uint4 gray = ((pixels.s048c + pixels.s159d + pixels.s26ae + 1) * 21846) >> 16;
+        vstore4(convert_uchar4(gray), 0, outImage + offset);
+        return;
+    }
+
+    // Tail of the row which is shorter than vector
+    for (int i = x; i < width; ++i, ++offset)
+    {
+        uint4 currentPixel = convert_uint4(vload4(0, inImage + offset * 4));
+        outImage[offset] = (uchar)(((currentPixel.x + currentPixel.y + currentPixel.z + 1) * 21846) >> 16);
+    }
+}
+
+// Side of work-group of convolution kernels, host code uses the same value for local size
+#define CONVOLUTION_GROUP_SIZE 16
+
+__constant sampler_t ClampSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+// Load block of work-group with apron to local memory, coordinates out of the input are clamped to edge
+void loadBlock(__read_only image2d_t inImage, __local float4 *block, int2 blockOrigin, int blockSide)
+{
+    for (int y = get_local_id(1); y < blockSide; y += CONVOLUTION_GROUP_SIZE)
+        for (int x = get_local_id(0); x < blockSide; x += CONVOLUTION_GROUP_SIZE)
+            block[y * blockSide + x] = read_imagef(inImage, ClampSampler, blockOrigin + (int2)(x, y));
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// inImage is the output tile with halo, pixel (x, y) of output is pixel (x + halo.x, y + halo.y) of input
+__kernel void convolveSeparable(__read_only image2d_t inImage, __write_only image2d_t outImage, __constant float *weights,
+                                int radius, int2 halo, __local float4 *block, __local float4 *rows)
+{
+    int blockSide = CONVOLUTION_GROUP_SIZE + 2 * radius;
+    int2 groupOrigin = (int2)(get_group_id(0), get_group_id(1)) * CONVOLUTION_GROUP_SIZE;
+    int x = get_local_id(0);
+    int y = get_local_id(1);
+    loadBlock(inImage, block, groupOrigin + halo - radius, blockSide);
+
+    // Horizontal pass for all rows of the block including apron
+    for (int row = y; row < blockSide; row += CONVOLUTION_GROUP_SIZE)
+    {
+        float4 sum = (float4)(0.0f);
+        for (int i = 0; i <= 2 * radius; ++i)
+            sum += weights[i] * block[row * blockSide + x + i];
+        rows[row * CONVOLUTION_GROUP_SIZE + x] = sum;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Vertical pass, all work-items have passed barriers, so padded ones can leave now
+    int2 position = groupOrigin + (int2)(x, y);
+    if (position.x >= get_image_width(outImage) || position.y >= get_image_height(outImage))
+        return;
+    float4 sum = (float4)(0.0f);
+    for (int i = 0; i <= 2 * radius; ++i)
+        sum += weights[i] * rows[(y + i) * CONVOLUTION_GROUP_SIZE + x];
+    write_imagef(outImage, position, (float4)(sum.xyz, 1.0f));
+}
+
+// Magnitude of Sobel gradient of gray, radius is always 1 and weights are not used
+__kernel void sobel(__read_only image2d_t inImage, __write_only image2d_t outImage, __constant float *weights,
+                    int radius, int2 halo, __local float4 *block, __local float4 *rows)
+{
+    int blockSide = CONVOLUTION_GROUP_SIZE + 2;
+    int2 groupOrigin = (int2)(get_group_id(0), get_group_id(1)) * CONVOLUTION_GROUP_SIZE;
+    int x = get_local_id(0);
+    int y = get_local_id(1);
+    loadBlock(inImage, block, groupOrigin + halo - 1, blockSide);
+
+    // Horizontal pass: smoothing (1 2 1) and derivative (-1 0 1) of gray
+    for (int row = y; row < blockSide; row += CONVOLUTION_GROUP_SIZE)
+    {
+        float4 left = block[row * blockSide + x];
+        float4 center = block[row * blockSide + x + 1];
+        float4 right = block[row * blockSide + x + 2];
+        float leftGray = (left.x + left.y + left.z) / 3;
+        float centerGray = (center.x + center.y + center.z) / 3;
+        float rightGray = (right.x + right.y + right.z) / 3;
+        rows[row * CONVOLUTION_GROUP_SIZE + x] = (float4)(leftGray + 2 * centerGray + rightGray, rightGray - leftGray, 0.0f, 0.0f);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Vertical pass: Gx is smoothed horizontal derivative, Gy is derivative of horizontal smoothing
+    int2 position = groupOrigin + (int2)(x, y);
+    if (position.x >= get_image_width(outImage) || position.y >= get_image_height(outImage))
+        return;
+    float4 top = rows[y * CONVOLUTION_GROUP_SIZE + x];
+    float4 middle = rows[(y + 1) * CONVOLUTION_GROUP_SIZE + x];
+    float4 bottom = rows[(y + 2) * CONVOLUTION_GROUP_SIZE + x];
+    float gradientX = top.y + 2 * middle.y + bottom.y;
+    float gradientY = bottom.x - top.x;
+    // Both gradients are in range from -4 to 4
+    float magnitude = clamp(sqrt(gradientX * gradientX + gradientY * gradientY) / 4, 0.0f, 1.0f);
+    write_imagef(outImage, position, (float4)(magnitude, magnitude, magnitude, 1.0f));
+}
+
+// Side of work-group of imageStatistics, host code uses the same value for local size
+#define STATISTICS_GROUP_SIZE 16
+#define HISTOGRAM_BINS 256
+// R, G, B and luma
+#define STATISTICS_CHANNELS 4
+// Layout of statistics buffer (uint), the same as in ImageStatistics on host:
+// histograms of all channels, minimums, maximums, sums and sums of squares as pairs of low and high parts
+#define STATISTICS_MIN_OFFSET (STATISTICS_CHANNELS * HISTOGRAM_BINS)
+#define STATISTICS_MAX_OFFSET (STATISTICS_MIN_OFFSET + STATISTICS_CHANNELS)
+#define STATISTICS_SUM_OFFSET (STATISTICS_MAX_OFFSET + STATISTICS_CHANNELS)
+#define STATISTICS_SQUARES_OFFSET (STATISTICS_SUM_OFFSET + 2 * STATISTICS_CHANNELS)
+
+// 64-bit accumulation by 32-bit atomics, carry goes to the high part when the low one wraps
+void atomicAdd64(volatile __global uint *value, uint addend)
+{
+    uint old = atomic_add(value, addend);
+    if (old + addend < old)
+        atomic_inc(value + 1);
+}
+
+__kernel void imageStatistics(__global const uchar *inImage, int width, int rowPitch, int height, volatile __global uint *statistics)
+{
+    __local uint histogram[STATISTICS_CHANNELS * HISTOGRAM_BINS];
+    __local uint4 minimum[STATISTICS_GROUP_SIZE * STATISTICS_GROUP_SIZE];
+    __local uint4 maximum[STATISTICS_GROUP_SIZE * STATISTICS_GROUP_SIZE];
+    __local uint4 sum[STATISTICS_GROUP_SIZE * STATISTICS_GROUP_SIZE];
+    __local uint4 squares[STATISTICS_GROUP_SIZE * STATISTICS_GROUP_SIZE];
+    int localId = get_local_id(1) * STATISTICS_GROUP_SIZE + get_local_id(0);
+    int groupSize = STATISTICS_GROUP_SIZE * STATISTICS_GROUP_SIZE;
+
+    for (int i = localId; i < STATISTICS_CHANNELS * HISTOGRAM_BINS; i += groupSize)
+        histogram[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Padded work-items take part in reductions with neutral values
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    minimum[localId] = (uint4)(UINT_MAX);
+    maximum[localId] = (uint4)(0);
+    sum[localId] = (uint4)(0);
+    squares[localId] = (uint4)(0);
+    if (x < width && y < height)
+    {
+        uint4 pixel = convert_uint4(vload4(0, inImage + ((size_t)y * rowPitch + x) * 4));
+        // Integer BT.601 luma replaces alpha
+        pixel.w = (pixel.x * 77 + pixel.y * 150 + pixel.z * 29) >> 8;
+        atomic_inc(&histogram[pixel.x]);
+        atomic_inc(&histogram[HISTOGRAM_BINS + pixel.y]);
+        atomic_inc(&histogram[2 * HISTOGRAM_BINS + pixel.z]);
+        atomic_inc(&histogram[3 * HISTOGRAM_BINS + pixel.w]);
+        minimum[localId] = pixel;
+        maximum[localId] = pixel;
+        sum[localId] = pixel;
+        squares[localId] = pixel * pixel;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Tree reduction in local memory, sums of one group fit to 32 bits
+    for (int stride = groupSize / 2; stride > 0; stride /= 2)
+    {
+        if (localId < stride)
+        {
+            minimum[localId] = min(minimum[localId], minimum[localId + stride]);
+            maximum[localId] = max(maximum[localId], maximum[localId + stride]);
+            sum[localId] += sum[localId + stride];
+            squares[localId] += squares[localId + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Results of the group are merged to global ones
+    for (int i = localId; i < STATISTICS_CHANNELS * HISTOGRAM_BINS; i += groupSize)
+    {
+        if (histogram[i] != 0)
+            atomic_add(&statistics[i], histogram[i]);
+    }
+    if (localId < STATISTICS_CHANNELS)
+    {
+        // Channels of the first element are results of the group
+        __local uint *groupMinimum = (__local uint *)minimum;
+        __local uint *groupMaximum = (__local uint *)maximum;
+        __local uint *groupSum = (__local uint *)sum;
+        __local uint *groupSquares = (__local uint *)squares;
+        atomic_min(&statistics[STATISTICS_MIN_OFFSET + localId], groupMinimum[localId]);
+        atomic_max(&statistics[STATISTICS_MAX_OFFSET + localId], groupMaximum[localId]);
+        atomicAdd64(&statistics[STATISTICS_SUM_OFFSET + 2 * localId], groupSum[localId]);
+        atomicAdd64(&statistics[STATISTICS_SQUARES_OFFSET + 2 * localId], groupSquares[localId]);
+    }
+}
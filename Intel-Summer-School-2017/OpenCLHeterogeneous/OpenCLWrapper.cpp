@@ -2,73 +2,164 @@
 #include "errorcodes.h"
 #include "colorenum.h"
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <exception>
 #include <iostream>
+#include <thread>
 #include <sstream>
 #include <fstream>
+#include <utility>
+
+// Number of tiles which can be in flight in pipelined mode (upload, kernel, read back)
+const size_t PIPELINE_DEPTH = 3;
+// Part of the distance to the balanced ratio which is passed after each tile in adaptive mode
+const cl_double RATIO_DAMPING = 0.5;
+// Device which should get less share of rows than this value is dropped in adaptive mode
+const cl_double RATIO_MIN_SHARE = 0.02;
+// Dropped device gets RATIO_MIN_SHARE of one tile of this many tiles to measure its speed again
+const size_t RATIO_PROBE_INTERVAL = 16;
+// Suffix of integer variant of kernel which processes several pixels per work-item
+const std::string INT_KERNEL_SUFFIX = "Int";
+// Should be the same as PIXELS_PER_WORK_ITEM in OpenCLImages.cl
+const size_t INT_KERNEL_PIXELS_PER_WORK_ITEM = 4;
+// Suffix of kernel which works with buffers instead of images
+const std::string BUFFER_KERNEL_SUFFIX = "Buffer";
+// Should be the same as BUFFER_PIXELS_PER_WORK_ITEM in OpenCLImages.cl
+const size_t BUFFER_PIXELS_PER_WORK_ITEM = 4;
+// Size of image and number of runs for choosing between kernel variants
+const size_t KERNEL_MEASURE_SIZE = 1024;
+const int KERNEL_MEASURE_RUNS = 3;
+// Side of work-group of convolution kernels, should be the same as CONVOLUTION_GROUP_SIZE in OpenCLImages.cl
+const size_t CONVOLUTION_GROUP_SIZE = 16;
+// Apron of the largest radius has to fit to local memory together with the work-group block
+const cl_int MAX_CONVOLUTION_RADIUS = 8;
+// Side of work-group of statistics kernel, should be the same as STATISTICS_GROUP_SIZE in OpenCLImages.cl
+const size_t STATISTICS_GROUP_SIZE = 16;
+// Names of ColorEnum values for -DCOLOR build option of specialized program variants
+const char *COLOR_NAMES[] = { "BW", "RED", "BLUE" };
+// Default size of tiles in the work queue of dynamic scheduling
+const size_t SCHEDULING_TILE_SIZE = 512;
+// The only kernel which has native implementation in host engine
+const std::string HOST_KERNEL_NAME = "maskToImage";
+// Kernel which writes only gray of BW maskToImage
+const std::string GRAY_KERNEL_NAME = "maskToGray";
+// Default share of rows of host engine when it participates in COMBO mode
+const cl_double HOST_SHARE = 0.25;
+// Runtimes use host memory of CL_MEM_USE_HOST_PTR objects without copies if it's aligned to page
+const size_t ZERO_COPY_ALIGNMENT = 4096;
 
 OpenCLWrapper::OpenCLWrapper()
-    : m_NDRangeRatio(0.5),
+    : m_resultsTarget(nullptr),
+      m_resultsData(nullptr),
+      m_resultsSize(0),
+      m_NDRangeRatio(0.5),
       m_writeTime(0),
-      m_readTime(0)
-{ }
+      m_readTime(0),
+      m_pipelined(false),
+      m_wallTime(0),
+      m_zeroCopy(true),
+      m_hostUnifiedMemory(false),
+      m_adaptiveRatio(false),
+      m_ratioProbeTiles(0),
+      m_dynamicScheduling(false),
+      m_schedulingTileWidth(SCHEDULING_TILE_SIZE),
+      m_schedulingTileHeight(SCHEDULING_TILE_SIZE),
+      m_cpuSubDevices(0),
+      m_buildTime(0),
+      m_tilingPlan(),
+      m_tileAutotune(false),
+      m_profiling(true),
+      m_tileWidth(0),
+      m_tileHeight(0),
+      m_imageFormat(CL_RGBA, CL_UNORM_INT8),
+      m_kernelAutoSelect(true),
+      m_cpuBackend(OpenCLBackend::Image),
+      m_gpuBackend(OpenCLBackend::Image),
+      m_specializedKernels(true),
+      m_convolutionRadius(0),
+      m_processedPixels(0),
+      m_hostFallback(true),
+      m_hostEngineUsed(false),
+      m_hostParticipant(false),
+      m_hostShare(HOST_SHARE),
+      m_hostProbeTiles(0),
+      m_hostKernelAvailable(false),
+      m_grayOutput(false),
+      m_outputBytesPerPixel(4)
+{
+    m_imgSize.x = 0;
+    m_imgSize.y = 0;
+}
 
 void OpenCLWrapper::setPlatformAndDevice(OpenCLPlatformType platformType, OpenCLDeviceType deviceType)
 {
-    if (platformType == OpenCLPlatformType::Intel)
+    m_hostEngineUsed = false;
+    if (platformType == OpenCLPlatformType::Host)
     {
-        m_platform = getIntelOCLPlatform();
+        m_hostEngineUsed = true;
+        return;
     }
-    else if (platformType == OpenCLPlatformType::AMD)
+
+    try
     {
-        m_platform = getATIOCLPlatform();
+        if (platformType == OpenCLPlatformType::Intel)
+        {
+            m_platform = getIntelOCLPlatform();
+        }
+        else if (platformType == OpenCLPlatformType::AMD)
+        {
+            m_platform = getATIOCLPlatform();
+        }
+        else if (platformType == OpenCLPlatformType::Any)
+        {
+            m_platform = getAnyOCLPlatform(deviceType == OpenCLDeviceType::CPU ? CL_DEVICE_TYPE_CPU : deviceType == OpenCLDeviceType::GPU ? CL_DEVICE_TYPE_GPU : CL_DEVICE_TYPE_ALL);
+        }
+        else
+        {
+            throw cl::Error(OCL_UNKNOWN_PLATFORM, "Error! Unknown platform!");
+        }
+
+        std::vector<cl::Device> devices;
+        if (deviceType == OpenCLDeviceType::CPU)
+            m_deviceType = CL_DEVICE_TYPE_CPU;
+        else if (deviceType == OpenCLDeviceType::GPU)
+            m_deviceType = CL_DEVICE_TYPE_GPU;
+        else
+            m_deviceType = CL_DEVICE_TYPE_ALL;
+        if (m_platform() != nullptr)
+            m_platform.getDevices(m_deviceType, &devices);
+        if (m_deviceType != CL_DEVICE_TYPE_ALL && !devices.empty())
+            devices.resize(1);
+        for (auto &device : devices)
+            m_devices.push_back(device);
     }
-    else
+    catch (cl::Error &err)
     {
-        throw cl::Error(OCL_UNKNOWN_PLATFORM, "Error! Unknown platform!");
+        // Missing OpenCL runtime or devices of the type, but not a wrong argument
+        if (!m_hostFallback || err.err() == OCL_UNKNOWN_PLATFORM)
+            throw;
+        m_devices.clear();
     }
 
-    std::vector<cl::Device> devices;
-    if (deviceType == OpenCLDeviceType::CPU)
+    if (m_devices.empty())
     {
-        m_deviceType = CL_DEVICE_TYPE_CPU;
-        m_platform.getDevices(m_deviceType, &devices);
-        m_devices.push_back(devices[0]);
-        m_xPieceSize = m_devices[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / (sizeof(unsigned char) * 4); // 4 is the number of array elements for one color (rgba)
-        m_yPieceSize = m_xPieceSize;
-    }
-    else if (deviceType == OpenCLDeviceType::GPU)
-    {
-        m_deviceType = CL_DEVICE_TYPE_GPU;
-        m_platform.getDevices(m_deviceType, &devices);
-        m_devices.push_back(devices[0]);
-        m_xPieceSize = m_devices[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / (sizeof(unsigned char) * 4); // 4 is the number of array elements for one color (rgba)
-        m_yPieceSize = m_xPieceSize;
-    }
-    else
-    {
-        m_deviceType = CL_DEVICE_TYPE_ALL;
-        m_platform.getDevices(m_deviceType, &devices);
-        m_xPieceSize = 0; m_yPieceSize = 0;
-        for (auto &device : devices)
-        {
-            m_devices.push_back(device);
-            auto maxAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / (sizeof(unsigned char) * 4);
-            if (m_xPieceSize == 0 || m_yPieceSize == 0)
-            {
-                m_xPieceSize = maxAllocSize;
-                m_yPieceSize = m_xPieceSize;
-            }
-            else
-            {
-                m_xPieceSize = std::min(m_xPieceSize, maxAllocSize);
-                m_yPieceSize = m_xPieceSize;
-            }
-        }
+        if (!m_hostFallback)
+            throw cl::Error(OCL_DEVICE_NOT_FOUND, "Error! OpenCL device is not found!");
+        m_hostEngineUsed = true;
+        // Host engine processes the whole image with BW mask, so masks of devices disappear from the result
+        std::cout << "OpenCL device is not found, host engine is used";
+        if (deviceType == OpenCLDeviceType::COMBO)
+            std::cout << ", results have no per-device masks";
+        std::cout << "." << std::endl;
     }
 }
 
 std::string OpenCLWrapper::getDeviceName()
 {
+    if (m_hostEngineUsed)
+        return m_hostEngine.getDescription() + "\n";
     std::ostringstream deviceNameStr;
     for (auto &device : m_devices)
     {
@@ -79,10 +170,21 @@ std::string OpenCLWrapper::getDeviceName()
 
 void OpenCLWrapper::createContextAndQueue()
 {
+    if (m_hostEngineUsed)
+        return;
+    if (m_deviceType == CL_DEVICE_TYPE_ALL && m_dynamicScheduling && m_cpuSubDevices > 1)
+        partitionCPUDevices();
+
     m_context = cl::Context(m_devices);
     if (m_deviceType != CL_DEVICE_TYPE_ALL)
     {
-        m_queue.push_back(cl::CommandQueue(m_context, m_devices[0], CL_QUEUE_PROFILING_ENABLE));
+        m_queue.push_back(cl::CommandQueue(m_context, m_devices[0], getQueueProperties()));
+    }
+    else if (m_dynamicScheduling)
+    {
+        // Each device has its own queue in the same order as m_devices
+        for (auto &device : m_devices)
+            m_queue.push_back(cl::CommandQueue(m_context, device, getQueueProperties()));
     }
     else
     {
@@ -96,9 +198,19 @@ void OpenCLWrapper::createContextAndQueue()
             else if (deviceType == CL_DEVICE_TYPE_GPU)
                 gpuDevice = device;
         }
-        m_queue.push_back(cl::CommandQueue(m_context, cpuDevice, CL_QUEUE_PROFILING_ENABLE));
-        m_queue.push_back(cl::CommandQueue(m_context, gpuDevice, CL_QUEUE_PROFILING_ENABLE));
+        // Host threads can take place of missing CPU device
+        if (gpuDevice() == nullptr || (cpuDevice() == nullptr && !m_hostParticipant))
+            throw cl::Error(OCL_DEVICE_NOT_FOUND, "Error! Both CPU and GPU devices are required for ratio between them!");
+        if (cpuDevice() != nullptr)
+            m_queue.push_back(cl::CommandQueue(m_context, cpuDevice, getQueueProperties()));
+        m_queue.push_back(cl::CommandQueue(m_context, gpuDevice, getQueueProperties()));
     }
+    m_imagePool.setContext(m_context);
+
+    m_hostUnifiedMemory = true;
+    for (auto &device : m_devices)
+        m_hostUnifiedMemory = m_hostUnifiedMemory && device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+    m_tilingPlanner.setDevices(m_devices);
 }
 
 void OpenCLWrapper::getProgramSourcesFromFile(std::string fileName)
@@ -122,42 +234,531 @@ void OpenCLWrapper::getProgramSourcesFromString(std::string src)
 
 void OpenCLWrapper::buildProgram(std::string options)
 {
-    m_program = cl::Program(m_context, m_source);
-    if (options.size() == 0)
-        m_program.build(m_devices);
+    m_buildOptions = options;
+    m_programVariants.clear();
+    // Host engine has native code of the kernel
+    if (m_hostEngineUsed)
+        return;
+    // Only programs used by devices are built, a single BW device doesn't need the generic one
+    for (size_t i = 0; i < m_queue.size(); ++i)
+        getDeviceProgram(i, m_source, "");
+}
+
+cl::Program OpenCLWrapper::compileProgram(const cl::Program::Sources &sources, const std::string &options)
+{
+    cl::Program program;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    if (m_programCache.isEnabled())
+    {
+        program = m_programCache.build(m_context, m_devices, sources, options);
+    }
     else
-        m_program.build(m_devices, options.c_str());
+    {
+        program = cl::Program(m_context, sources);
+        if (options.size() == 0)
+            program.build(m_devices);
+        else
+            program.build(m_devices, options.c_str());
+    }
+    auto endTime = std::chrono::high_resolution_clock::now();
+    m_buildTime += std::chrono::duration<cl_double, std::milli>(endTime - startTime).count();
+    return program;
+}
+
+std::string OpenCLWrapper::getVariantOptions(int color)
+{
+    if (!m_specializedKernels)
+        return m_buildOptions;
+    return m_buildOptions + (m_buildOptions.empty() ? "" : " ") + "-DCOLOR=" + COLOR_NAMES[color];
+}
+
+cl::Program OpenCLWrapper::getDeviceProgram(size_t deviceIndex, const cl::Program::Sources &sources, const std::string &signature)
+{
+    // Without specialization the options are the same for all colors, so devices share the generic program
+    return getProgramVariant(sources, signature, getVariantOptions(getDeviceColor(m_queue[deviceIndex])));
+}
+
+cl::Program OpenCLWrapper::getProgramVariant(const cl::Program::Sources &sources, const std::string &signature, const std::string &options)
+{
+    // Variants are keyed by signature of generated source and build options, so devices with the same color share one program
+    auto key = signature + "\n" + options;
+    auto variant = m_programVariants.find(key);
+    if (variant != m_programVariants.end())
+        return variant->second;
+    auto program = compileProgram(sources, options);
+    m_programVariants[key] = program;
+    return program;
+}
+
+int OpenCLWrapper::getDeviceColor(const cl::CommandQueue &queue)
+{
+    // In heterogeneous mode the mask shows which device processed the pixel
+    if (m_deviceType != CL_DEVICE_TYPE_ALL)
+        return BW;
+    cl_device_type deviceType = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_TYPE>();
+    return (deviceType == CL_DEVICE_TYPE_CPU) ? BLUE : (deviceType == CL_DEVICE_TYPE_GPU) ? RED : BW;
 }
 
 void OpenCLWrapper::createInputAndOutputImages(std::vector<unsigned char> &img, cl_int2 imgSize)
 {
-    m_imgSource = img;
+    std::vector<unsigned char> copy(img);
+    createInputAndOutputImages(std::move(copy), imgSize);
+}
+
+void OpenCLWrapper::createInputAndOutputImages(std::vector<unsigned char> &&img, cl_int2 imgSize)
+{
+    Tracer::Span span(m_tracer, "prepare image");
+    m_imgSource.swap(img);
+    // Tiles of another image size need other objects, the pool would keep the old ones until the context is released
+    if (m_imgSize.x != imgSize.x || m_imgSize.y != imgSize.y)
+        m_imagePool.releaseDeviceMemory();
     m_imgSize = imgSize;
-    m_results.resize(m_imgSource.size());
+    allocateResults();
+    // Zero-copy memory is kept over buffers of this image and of the previous input, which callers reuse for the next image
+    m_imagePool.retainHostMemory({ std::make_pair(m_imgSource.data(), m_imgSource.data() + m_imgSource.size()),
+                                   std::make_pair(img.data(), img.data() + img.size()),
+                                   std::make_pair(m_resultsData, m_resultsData + m_resultsSize) });
+    // Host engine processes the whole image in place, without tiles
+    if (!m_hostEngineUsed)
+        planTiles();
+}
+
+void OpenCLWrapper::allocateResults()
+{
+    m_resultsSize = (size_t)m_imgSize.x * m_imgSize.y * m_outputBytesPerPixel;
+    if (m_resultsTarget != nullptr)
+    {
+        // Internal buffer isn't needed while results go to the target
+        std::vector<unsigned char>().swap(m_results);
+        m_resultsData = m_resultsTarget;
+    }
+    else
+    {
+        // Results start at page boundary, so zero-copy memory over them isn't copied by runtime
+        m_results.resize(m_resultsSize + ZERO_COPY_ALIGNMENT - 1);
+        auto address = reinterpret_cast<uintptr_t>(m_results.data());
+        m_resultsData = m_results.data() + ((ZERO_COPY_ALIGNMENT - address % ZERO_COPY_ALIGNMENT) % ZERO_COPY_ALIGNMENT);
+    }
+}
+
+void OpenCLWrapper::planTiles()
+{
+    m_tilingPlan = m_tilingPlanner.plan(m_imgSize.x, m_imgSize.y, getTilesInFlight(), 4, m_outputBytesPerPixel, m_convolutionRadius);
+
+    // Tile which was measured for images of this size is reused
+    auto tuned = m_tunedTiles.find(std::make_pair(m_tilingPlan.imageWidth, m_tilingPlan.imageHeight));
+    if (tuned != m_tunedTiles.end())
+    {
+        m_tilingPlan.tileWidth = tuned->second.first;
+        m_tilingPlan.tileHeight = tuned->second.second;
+        m_tilingPlan.measured = true;
+    }
+    if (m_tileWidth != 0 && m_tileHeight != 0)
+    {
+        // Tile size set by user is only limited by the plan
+        m_tilingPlan.tileWidth = std::min(m_tileWidth, m_tilingPlan.maxTileWidth);
+        m_tilingPlan.tileHeight = std::max<size_t>(std::min(std::min(m_tileHeight, m_tilingPlan.maxTileHeight), m_tilingPlan.maxTilePixels / m_tilingPlan.tileWidth), 1);
+        m_tilingPlan.measured = true;
+    }
+    m_xPieceSize = m_tilingPlan.tileWidth;
+    m_yPieceSize = m_tilingPlan.tileHeight;
+}
+
+void OpenCLWrapper::setResultsTarget(unsigned char *pixels)
+{
+    if (m_resultsTarget != nullptr && m_resultsData == m_resultsTarget)
+    {
+        // Results and cached zero-copy memory over the old target can't be used after it's released
+        m_resultsData = nullptr;
+        m_resultsSize = 0;
+        m_imagePool.retainHostMemory({ std::make_pair(m_imgSource.data(), m_imgSource.data() + m_imgSource.size()) });
+    }
+    m_resultsTarget = pixels;
+}
 
-    m_xPieceSize /= m_imgSize.y;
-    m_yPieceSize /= m_imgSize.x;
+size_t OpenCLWrapper::getTilesInFlight()
+{
+    // Input and output images of every tile in flight have to fit to device memory at the same time
+    if (m_deviceType != CL_DEVICE_TYPE_ALL && m_pipelined)
+        return PIPELINE_DEPTH;
+    if (m_deviceType == CL_DEVICE_TYPE_ALL && m_dynamicScheduling)
+        return m_queue.size();
+    return 1;
+}
+
+size_t OpenCLWrapper::getStripHeight(cl_int2 imgSize, size_t maxStripBytes)
+{
+    if (m_convolutionRadius > 0)
+        throw cl::Error(OCL_STREAM_UNSUPPORTED, "Error! Convolution can't be processed by strips!");
+    size_t width = imgSize.s[0];
+    size_t height = imgSize.s[1];
+    // Budget is the upper bound, tiles of the strip are planned for the strip and can't be higher than it
+    size_t stripHeight = std::min<size_t>(std::max<size_t>(maxStripBytes / (width * (4 + m_outputBytesPerPixel)), 1), height);
+    if (!m_hostEngineUsed)
+    {
+        // Tile size set by user or measured for the full image is kept, strips are whole rows of tiles if they fit
+        size_t tileHeight = m_tilingPlanner.plan(width, height, getTilesInFlight(), 4, m_outputBytesPerPixel, m_convolutionRadius).tileHeight;
+        auto tuned = m_tunedTiles.find(std::make_pair(width, height));
+        if (m_tileWidth != 0 && m_tileHeight != 0)
+            tileHeight = m_tileHeight;
+        else if (tuned != m_tunedTiles.end())
+            tileHeight = tuned->second.second;
+        if (tileHeight < stripHeight)
+            stripHeight = stripHeight / tileHeight * tileHeight;
+    }
+    return stripHeight;
+}
+
+void OpenCLWrapper::tuneTileSize()
+{
+    Tracer::Span span(m_tracer, "tune tile size");
+    // Every candidate is measured on one tile in the top left corner, the best time per pixel wins
+    cl_double bestTime = 0;
+    auto candidates = m_tilingPlanner.getCandidates(m_tilingPlan);
+    for (auto &candidate : candidates)
+    {
+        Tile tile = { 0, 0, candidate.first, candidate.second };
+        cl_double time = 0;
+        // The first launch is a warm-up
+        for (int i = 0; i < 2; ++i)
+        {
+            auto startTime = std::chrono::high_resolution_clock::now();
+            auto input = acquireTileMemory(tile, true, 0);
+            auto output = acquireTileMemory(tile, false, 0);
+            cl::Event event;
+            enqueueWriteTile(m_queue[0], tile, input, CL_FALSE, &event);
+            setKernelArgs(m_deviceKernels[0], input, output, m_deviceColors[0], tile);
+            enqueueTileKernel(0, tile, nullptr, nullptr);
+            auto mappedPtr = enqueueReadTile(m_queue[0], tile, output, CL_TRUE, nullptr, &event);
+            finishReadTile(m_queue[0], output, mappedPtr);
+            m_queue[0].finish();
+            releaseTileMemory(input);
+            releaseTileMemory(output);
+            auto endTime = std::chrono::high_resolution_clock::now();
+            time = std::chrono::duration<cl_double, std::milli>(endTime - startTime).count() / (tile.width * tile.height);
+        }
+        if (bestTime == 0 || time < bestTime)
+        {
+            bestTime = time;
+            m_tilingPlan.tileWidth = tile.width;
+            m_tilingPlan.tileHeight = tile.height;
+        }
+    }
+    m_tilingPlan.measured = true;
+    m_tunedTiles[std::make_pair(m_tilingPlan.imageWidth, m_tilingPlan.imageHeight)] = std::make_pair(m_tilingPlan.tileWidth, m_tilingPlan.tileHeight);
+    m_xPieceSize = m_tilingPlan.tileWidth;
+    m_yPieceSize = m_tilingPlan.tileHeight;
+}
+
+void OpenCLWrapper::setBackend(OpenCLDeviceType deviceType, OpenCLBackend backend)
+{
+    if (deviceType != OpenCLDeviceType::GPU)
+        m_cpuBackend = backend;
+    if (deviceType != OpenCLDeviceType::CPU)
+        m_gpuBackend = backend;
 }
 
 void OpenCLWrapper::createKernel(std::string kernelName)
 {
-    m_kernel = cl::Kernel(m_program, kernelName.c_str());
+    m_convolutionRadius = 0;
+    if (m_hostEngineUsed)
+    {
+        if (kernelName != HOST_KERNEL_NAME)
+            throw cl::Error(OCL_HOST_UNSUPPORTED, std::string("Error! Kernel " + kernelName + " isn't supported by host engine!").c_str());
+        m_kernelName = kernelName;
+        return;
+    }
+    m_hostKernelAvailable = (kernelName == HOST_KERNEL_NAME);
+    setDeviceBackendsAndColors();
+    // Masks of devices in heterogeneous mode need all channels, image backends need one-channel images
+    bool gray = m_grayOutput && kernelName == HOST_KERNEL_NAME && std::count(m_deviceColors.begin(), m_deviceColors.end(), BW) == (std::ptrdiff_t)m_deviceColors.size();
+    if (gray && std::count(m_deviceBackends.begin(), m_deviceBackends.end(), OpenCLBackend::Image) != 0)
+        gray = isImageFormatSupported(cl::ImageFormat(CL_R, CL_UNORM_INT8), CL_MEM_WRITE_ONLY);
+    if (gray)
+        kernelName = GRAY_KERNEL_NAME;
+    m_kernelName = kernelName;
+    setDeviceVariants(kernelName);
+    if (m_kernelAutoSelect)
+        selectKernelVariant(kernelName);
+    setOutputBytesPerPixel(gray ? 1 : 4);
+    createDeviceKernels(kernelName + BUFFER_KERNEL_SUFFIX, m_source, "");
+}
+
+void OpenCLWrapper::setOutputBytesPerPixel(size_t bytesPerPixel)
+{
+    bool changed = (bytesPerPixel != m_outputBytesPerPixel);
+    m_outputBytesPerPixel = bytesPerPixel;
+    // Images created before the kernel get results of its format and tiles planned with its halo
+    if (m_resultsData == nullptr)
+        return;
+    if (changed)
+    {
+        if (m_resultsTarget != nullptr)
+            throw cl::Error(OCL_NO_IMAGE, "Error! Results target was created for another output format, images have to be created again!");
+        allocateResults();
+        m_imagePool.retainHostMemory({ std::make_pair(m_imgSource.data(), m_imgSource.data() + m_imgSource.size()),
+                                       std::make_pair(m_resultsData, m_resultsData + m_resultsSize) });
+    }
+    planTiles();
+}
+
+void OpenCLWrapper::setDeviceVariants(const std::string &kernelName)
+{
+    m_deviceKernelNames.assign(m_queue.size(), kernelName);
+    m_deviceImageFormats.assign(m_queue.size(), m_imageFormat);
+    m_devicePixelsPerWorkItem.assign(m_queue.size(), 1);
+}
+
+bool OpenCLWrapper::isImageFormatSupported(const cl::ImageFormat &format, cl_mem_flags flags)
+{
+    std::vector<cl::ImageFormat> formats;
+    m_context.getSupportedImageFormats(flags, CL_MEM_OBJECT_IMAGE2D, &formats);
+    for (auto &supported : formats)
+    {
+        if (supported.image_channel_order == format.image_channel_order && supported.image_channel_data_type == format.image_channel_data_type)
+            return true;
+    }
+    return false;
+}
+
+cl::ImageFormat OpenCLWrapper::getOutputImageFormat(size_t deviceIndex)
+{
+    // Gray results have one channel, others have the same format as input of the device
+    return (m_outputBytesPerPixel == 1) ? cl::ImageFormat(CL_R, CL_UNORM_INT8) : m_deviceImageFormats[deviceIndex];
+}
+
+void OpenCLWrapper::createPipelineKernel(const FilterPipeline &pipeline)
+{
+    Tracer::Span span(m_tracer, "create pipeline kernel");
+    if (m_hostEngineUsed)
+        throw cl::Error(OCL_HOST_UNSUPPORTED, "Error! Filter pipeline isn't supported by host engine!");
+    m_convolutionRadius = 0;
+    m_hostKernelAvailable = false;
+    setDeviceBackendsAndColors();
+    m_kernelName = pipeline.getKernelName();
+    setDeviceVariants(m_kernelName);
+    setOutputBytesPerPixel(4);
+    auto source = pipeline.generateSource();
+    cl::Program::Sources sources = { { source.c_str(), source.length() } };
+    createDeviceKernels(m_kernelName + BUFFER_KERNEL_SUFFIX, sources, pipeline.getSignature());
+}
+
+void OpenCLWrapper::createConvolutionKernel(ConvolutionType type, cl_int radius)
+{
+    if (m_hostEngineUsed)
+        throw cl::Error(OCL_HOST_UNSUPPORTED, "Error! Convolution isn't supported by host engine!");
+    if (type == ConvolutionType::Sobel)
+        radius = 1;
+    if (radius < 1 || radius > MAX_CONVOLUTION_RADIUS)
+        throw cl::Error(OCL_BAD_CONVOLUTION, "Error! Radius of convolution is out of range!");
+
+    // Weights of one dimension, the same weights are used for rows and columns
+    std::vector<cl_float> weights(2 * radius + 1, 1.0f);
+    if (type == ConvolutionType::Gaussian)
+    {
+        cl_float sigma = radius / 2.0f;
+        for (cl_int i = -radius; i <= radius; ++i)
+            weights[i + radius] = std::exp(-(i * i) / (2 * sigma * sigma));
+    }
+    cl_float sum = 0;
+    for (auto &weight : weights)
+        sum += weight;
+    for (auto &weight : weights)
+        weight /= sum;
+
+    // Neighbors are read through sampler with clamping to edge, so convolution always works with images
+    setDeviceBackendsAndColors();
+    for (auto &backend : m_deviceBackends)
+        backend = OpenCLBackend::Image;
+    m_hostKernelAvailable = false;
+    m_convolutionRadius = radius;
+    m_convolutionWeights = cl::Buffer(m_context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, weights.size() * sizeof(cl_float), &weights[0]);
+    m_kernelName = (type == ConvolutionType::Sobel) ? "sobel" : "convolveSeparable";
+    setDeviceVariants(m_kernelName);
+    setOutputBytesPerPixel(4);
+    m_deviceKernels.clear();
+    for (size_t i = 0; i < m_deviceBackends.size(); ++i)
+        m_deviceKernels.push_back(cl::Kernel(getDeviceProgram(i, m_source, ""), m_kernelName.c_str()));
+}
+
+OpenCLWrapper::Tile OpenCLWrapper::getInputTile(const Tile &tile)
+{
+    // Halo is cut at borders of the image, there sampler clamps coordinates to edge of the tile
+    size_t radius = m_convolutionRadius;
+    size_t xOffset = tile.xOffset - std::min(radius, tile.xOffset);
+    size_t yOffset = tile.yOffset - std::min(radius, tile.yOffset);
+    size_t right = std::min(tile.xOffset + tile.width + radius, (size_t)m_imgSize.x);
+    size_t bottom = std::min(tile.yOffset + tile.height + radius, (size_t)m_imgSize.y);
+    return { xOffset, yOffset, right - xOffset, bottom - yOffset };
+}
+
+void OpenCLWrapper::setDeviceBackendsAndColors()
+{
+    m_deviceBackends.clear();
+    m_deviceColors.clear();
+    for (auto &queue : m_queue)
+    {
+        cl_device_type deviceType = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_TYPE>();
+        m_deviceBackends.push_back(deviceType == CL_DEVICE_TYPE_CPU ? m_cpuBackend : m_gpuBackend);
+        m_deviceColors.push_back(getDeviceColor(queue));
+    }
+}
+
+void OpenCLWrapper::createDeviceKernels(const std::string &bufferKernelName, const cl::Program::Sources &sources, const std::string &signature)
+{
+    // Devices launch kernels concurrently in combo and dynamic modes, so each of them needs own kernel
+    m_deviceKernels.clear();
+    for (size_t i = 0; i < m_deviceBackends.size(); ++i)
+    {
+        auto &name = (m_deviceBackends[i] == OpenCLBackend::Buffer) ? bufferKernelName : m_deviceKernelNames[i];
+        // Programs of the source are already built by buildProgram, generated ones are built here
+        m_deviceKernels.push_back(cl::Kernel(getDeviceProgram(i, sources, signature), name.c_str()));
+    }
+}
+
+void OpenCLWrapper::selectKernelVariant(std::string kernelName)
+{
+    // Every device with image backend gets the variant which is faster on it, devices with buffer backend run buffer kernel
+    cl::ImageFormat intFormat(CL_RGBA, CL_UNSIGNED_INT8);
+    for (size_t i = 0; i < m_queue.size(); ++i)
+    {
+        if (m_deviceBackends[i] != OpenCLBackend::Image)
+            continue;
+        auto program = getDeviceProgram(i, m_source, "");
+        cl::Kernel intKernel;
+        try
+        {
+            intKernel = cl::Kernel(program, (kernelName + INT_KERNEL_SUFFIX).c_str());
+        }
+        catch (cl::Error &)
+        {
+            // Program doesn't have integer variant of this kernel
+            return;
+        }
+        cl::Kernel kernel(program, kernelName.c_str());
+        auto time = measureKernel(i, kernel, m_imageFormat, 1);
+        auto intTime = measureKernel(i, intKernel, intFormat, INT_KERNEL_PIXELS_PER_WORK_ITEM);
+        if (intTime < time)
+        {
+            m_deviceKernelNames[i] = kernelName + INT_KERNEL_SUFFIX;
+            m_deviceImageFormats[i] = intFormat;
+            m_devicePixelsPerWorkItem[i] = INT_KERNEL_PIXELS_PER_WORK_ITEM;
+        }
+    }
+}
+
+cl_double OpenCLWrapper::measureKernel(size_t deviceIndex, cl::Kernel &kernel, const cl::ImageFormat &format, size_t pixelsPerWorkItem)
+{
+    auto &queue = m_queue[deviceIndex];
+    cl::Image2D inputImage(m_context, CL_MEM_READ_ONLY, format, KERNEL_MEASURE_SIZE, KERNEL_MEASURE_SIZE);
+    cl::Image2D outputImage(m_context, CL_MEM_WRITE_ONLY, format, KERNEL_MEASURE_SIZE, KERNEL_MEASURE_SIZE);
+    cl::NDRange globalRange((KERNEL_MEASURE_SIZE + pixelsPerWorkItem - 1) / pixelsPerWorkItem, KERNEL_MEASURE_SIZE);
+    kernel.setArg(0, inputImage);
+    kernel.setArg(1, outputImage);
+    kernel.setArg(2, BW);
+    // The first launch is a warm-up
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, cl::NullRange);
+    queue.finish();
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < KERNEL_MEASURE_RUNS; ++i)
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, cl::NullRange);
+    queue.finish();
+    auto endTime = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<cl_double, std::milli>(endTime - startTime).count();
+}
+
+size_t OpenCLWrapper::getGlobalWidth(size_t deviceIndex, size_t width)
+{
+    size_t pixelsPerWorkItem = (m_deviceBackends[deviceIndex] == OpenCLBackend::Buffer) ? BUFFER_PIXELS_PER_WORK_ITEM : m_devicePixelsPerWorkItem[deviceIndex];
+    return (width + pixelsPerWorkItem - 1) / pixelsPerWorkItem;
+}
+
+void OpenCLWrapper::enqueueTileKernel(size_t deviceIndex, const Tile &tile, const std::vector<cl::Event> *waitList, cl::Event *event)
+{
+    auto &queue = m_queue[deviceIndex];
+    auto &kernel = m_deviceKernels[deviceIndex];
+    size_t globalWidth = getGlobalWidth(deviceIndex, tile.width);
+    if (m_convolutionRadius > 0)
+    {
+        // Size of local memory depends on the work-group size, so it's fixed for convolution
+        cl::NDRange globalRange(LocalSizeTuner::padGlobalSize(tile.width, CONVOLUTION_GROUP_SIZE), LocalSizeTuner::padGlobalSize(tile.height, CONVOLUTION_GROUP_SIZE));
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, cl::NDRange(CONVOLUTION_GROUP_SIZE, CONVOLUTION_GROUP_SIZE), waitList, event);
+        return;
+    }
+    if (!m_localSizeTuner.isEnabled())
+    {
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(globalWidth, tile.height), cl::NullRange, waitList, event);
+        return;
+    }
+
+    // Global size is padded to a multiple of the local one, kernels skip work-items out of the tile
+    auto localSize = m_localSizeTuner.getLocalSize(queue, kernel, globalWidth, tile.height, waitList);
+    cl::NDRange globalRange(LocalSizeTuner::padGlobalSize(globalWidth, localSize.first), LocalSizeTuner::padGlobalSize(tile.height, localSize.second));
+    cl::NDRange localRange = (localSize.first == 0) ? cl::NullRange : cl::NDRange(localSize.first, localSize.second);
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, localRange, waitList, event);
 }
 
 void OpenCLWrapper::runKernel()
 {
-    if (m_deviceType != CL_DEVICE_TYPE_ALL)
+    Tracer::Span span(m_tracer, "run");
+    if (m_resultsData == nullptr)
+        throw cl::Error(OCL_NO_IMAGE, "Error! Input and output images have to be created before run!");
+    if (m_tileAutotune && !m_tilingPlan.measured && !m_hostEngineUsed)
+        tuneTileSize();
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    if (m_hostEngineUsed)
+    {
+        runOnHost();
+    }
+    else if (m_deviceType != CL_DEVICE_TYPE_ALL)
+    {
+        if (m_pipelined)
+            runOnOneDevicePipelined();
+        else
+            runOnOneDevice();
+    }
+    else if (m_dynamicScheduling)
     {
-        runOnOneDevice();
+        runDynamic();
     }
     else
     {
         runOnCombo();
     }
+    auto endTime = std::chrono::high_resolution_clock::now();
+    m_wallTime += std::chrono::duration<cl_double, std::milli>(endTime - startTime).count();
+    m_processedPixels += (size_t)m_imgSize.x * m_imgSize.y;
 }
 
 void OpenCLWrapper::printTimes()
 {
+    if (!m_profiling)
+    {
+        std::cout << "Profiling is disabled." << std::endl;
+        std::cout << "Wall-clock time of running: " << m_wallTime << " ms." << std::endl;
+        if (m_wallTime > 0)
+            std::cout << "Throughput: " << m_processedPixels / (m_wallTime * 1000) << " MPixels/s." << std::endl;
+        return;
+    }
+    std::cout << "Time of building program: " << m_buildTime << " ms.";
+    if (m_programCache.isEnabled())
+        std::cout << " (binary cache: " << m_programCache.getHits() << " hits, " << m_programCache.getMisses() << " misses)";
+    std::cout << std::endl;
+    std::cout << "Kernel: " << m_kernelName;
+    for (size_t i = 0; i < m_deviceBackends.size(); ++i)
+    {
+        std::cout << (i == 0 ? " (" : ", ");
+        if (m_deviceBackends[i] == OpenCLBackend::Buffer)
+            std::cout << "buffer";
+        else
+            std::cout << m_deviceKernelNames[i] << " image";
+    }
+    std::cout << (m_deviceBackends.empty() ? "" : " backend)") << std::endl;
+    if (!m_programVariants.empty())
+        std::cout << "Program variants: " << m_programVariants.size() << std::endl;
+    if (m_localSizeTuner.isEnabled())
+        std::cout << "Local sizes tuned in this run: " << m_localSizeTuner.getTunedCount() << std::endl;
     std::cout << "Time of writing image to device: " << m_writeTime << " ms." << std::endl;
 
     if (m_kernelNDRangeTimes.size() == 1)
@@ -166,11 +767,28 @@ void OpenCLWrapper::printTimes()
     }
     else
     {
-        std::cout << "Execution CPU time: " << m_kernelNDRangeTimes[0] << " ms." << std::endl;
-        std::cout << "Execution GPU time: " << m_kernelNDRangeTimes[1] << " ms." << std::endl;
+        for (size_t i = 0; i < m_kernelNDRangeTimes.size(); ++i)
+        {
+            std::cout << "Execution " << m_kernelNDRangeNames[i] << " time: " << m_kernelNDRangeTimes[i] << " ms.";
+            if (i < m_deviceTiles.size())
+                std::cout << " (" << m_deviceTiles[i] << " tiles)";
+            std::cout << std::endl;
+        }
+        if (!m_dynamicScheduling && m_queue.size() == 2)
+            std::cout << "Ratio between CPU and GPU: " << m_NDRangeRatio << std::endl;
+        if (isHostParticipating())
+            std::cout << "Host share of rows: " << m_hostShare << std::endl;
     }
 
     std::cout << "Time of reading image from device: " << m_readTime << " ms." << std::endl;
+
+    cl_double commandsTime = m_writeTime + m_readTime;
+    for (auto &time : m_kernelNDRangeTimes)
+        commandsTime += time;
+    std::cout << "Image pool: " << m_imagePool.getHits() << " hits, " << m_imagePool.getMisses() << " misses (allocations)." << std::endl;
+    std::cout << "Wall-clock time of running: " << m_wallTime << " ms. (sum of commands time: " << commandsTime << " ms.)" << std::endl;
+    if (m_wallTime > 0)
+        std::cout << "Throughput: " << m_processedPixels / (m_wallTime * 1000) << " MPixels/s." << std::endl;
 }
 
 cl::Platform OpenCLWrapper::getIntelOCLPlatform()
@@ -203,6 +821,28 @@ cl::Platform OpenCLWrapper::getATIOCLPlatform()
     return cl::Platform();
 }
 
+cl::Platform OpenCLWrapper::getAnyOCLPlatform(cl_device_type deviceType)
+{
+    std::vector<cl::Platform> platforms;
+    cl::Platform::get(&platforms);
+    for (auto &platform : platforms)
+    {
+        std::vector<cl::Device> devices;
+        try
+        {
+            platform.getDevices(deviceType, &devices);
+        }
+        catch (cl::Error &)
+        {
+            // Platform doesn't have devices of this type
+        }
+        if (!devices.empty())
+            return platform;
+    }
+
+    return cl::Platform();
+}
+
 bool OpenCLWrapper::isCPUDevicePresented()
 {
     std::vector<cl::Device> devices;
@@ -219,168 +859,727 @@ bool OpenCLWrapper::isGPUDevicePresented()
 
 void OpenCLWrapper::runOnOneDevice()
 {
-    cl::size_t<3> origin;
-    cl::size_t<3> region;
-    size_t rowPitch = 0;
-    size_t slicePitch = 0;
-    int xNumberOfPieces = m_imgSize.x / m_xPieceSize;
-    int yNumberOfPieces = m_imgSize.y / m_yPieceSize;
-    xNumberOfPieces = (m_imgSize.x % m_xPieceSize) ? xNumberOfPieces + 1 : xNumberOfPieces;
-    yNumberOfPieces = (m_imgSize.y % m_yPieceSize) ? yNumberOfPieces + 1 : yNumberOfPieces;
     m_kernelEvents.resize(1);
     m_kernelNDRangeTimes.resize(1, 0);
-    origin[0] = 0; origin[1] = 0; origin[2] = 0;
-    cl::ImageFormat format(CL_RGBA, CL_UNORM_INT8); // structure to define image description
 
-    for (int x = 0; x < xNumberOfPieces; ++x)
+    for (auto &tile : splitIntoTiles(m_xPieceSize, m_yPieceSize))
     {
-        auto width = m_xPieceSize; auto height = m_yPieceSize;
-        for (int y = 0; y < yNumberOfPieces; ++y)
+        m_inputMemory = acquireTileMemory(tile, true, 0);
+        m_outputMemory = acquireTileMemory(tile, false, 0);
+
+        enqueueWriteTile(m_queue[0], tile, m_inputMemory, CL_TRUE, &m_writeEvent);
+        traceCommand(m_queue[0], "write", tile, &m_writeEvent);
+        m_writeEvent.wait();
+        m_writeTime += getEventTime(m_writeEvent);
+
+        setKernelArgs(m_deviceKernels[0], m_inputMemory, m_outputMemory, m_deviceColors[0], tile);
+        enqueueTileKernel(0, tile, nullptr, &m_kernelEvents[0]);
+        traceCommand(m_queue[0], "kernel", tile, &m_kernelEvents[0]);
+        m_queue[0].finish();
+
+        cl::Event::waitForEvents(m_kernelEvents);
+        m_kernelNDRangeTimes[0] += getEventTime(m_kernelEvents[0]);
+
+        auto mappedPtr = enqueueReadTile(m_queue[0], tile, m_outputMemory, CL_TRUE, nullptr, &m_readEvent);
+        traceCommand(m_queue[0], "read", tile, &m_readEvent);
+        m_readEvent.wait();
+        m_readTime += getEventTime(m_readEvent);
+        finishReadTile(m_queue[0], m_outputMemory, mappedPtr);
+
+        releaseTileMemory(m_inputMemory);
+        releaseTileMemory(m_outputMemory);
+    }
+    m_queue[0].finish();
+}
+
+void OpenCLWrapper::runOnCombo()
+{
+    // Queues are CPU and GPU (or only GPU when host takes place of CPU), host threads are the last participant
+    size_t queuesCount = m_queue.size();
+    bool hasCPUQueue = (queuesCount == 2);
+    bool hostParticipating = isHostParticipating();
+    m_kernelEvents.resize(queuesCount);
+    m_kernelNDRangeNames = hasCPUQueue ? std::vector<std::string>{ "CPU", "GPU" } : std::vector<std::string>{ "GPU" };
+    if (hostParticipating)
+        m_kernelNDRangeNames.push_back("Host");
+    m_kernelNDRangeTimes.resize(m_kernelNDRangeNames.size(), 0);
+
+    for (auto &tile : splitIntoTiles(m_xPieceSize, m_yPieceSize))
+    {
+        // Host takes its share first, GPU gets rest of rows, so no row is lost by rounding
+        size_t hostRows = hostParticipating ? static_cast<size_t>(tile.height * getProbedShare(m_hostShare, m_hostProbeTiles)) : 0;
+        size_t devicesRows = tile.height - hostRows;
+        cl_double ratio = hasCPUQueue ? getProbedShare(m_NDRangeRatio, m_ratioProbeTiles) : m_NDRangeRatio;
+        size_t cpuRows = hasCPUQueue ? static_cast<size_t>(devicesRows * (1 - ratio)) : 0;
+        size_t gpuRows = devicesRows - cpuRows;
+        // Every device transfers and processes its own part of the tile in memory of its backend
+        Tile parts[2] = { { tile.xOffset, tile.yOffset, tile.width, cpuRows }, { tile.xOffset, tile.yOffset + cpuRows, tile.width, gpuRows } };
+        Tile hostPart = { tile.xOffset, tile.yOffset + devicesRows, tile.width, hostRows };
+        // Part of queue i, CPU part is skipped when there is no CPU queue
+        Tile *queueParts = hasCPUQueue ? parts : parts + 1;
+        TileMemory inputs[2];
+        TileMemory outputs[2];
+        cl::Event writeEvents[2];
+        cl::Event readEvents[2];
+        void *mappedPtrs[2] = { nullptr, nullptr };
+        cl_double times[2] = { 0, 0 };
+        // Time of device parts from the upload to the end of reading, host part is measured the same way
+        cl_double devicesTime = 0;
+
+        for (size_t i = 0; i < queuesCount; ++i)
         {
-            auto xOffset = x*m_xPieceSize;
-            auto yOffset = y*m_yPieceSize;
-            width = ((xOffset + width) > m_imgSize.x) ? (m_imgSize.x - xOffset) : width;
-            height = ((yOffset + height) > m_imgSize.y) ? (m_imgSize.y - yOffset) : height;
-            region[0] = width; region[1] = height; region[2] = 1;
-
-            auto imgPiece = splitImage(xOffset, yOffset, width, height);
-            // Allocate input_image
-            m_inputImage = cl::Image2D(m_context, CL_MEM_READ_ONLY, format, width, height);
-            // Allocate non-initialized output buffer
-            m_outputImage = cl::Image2D(m_context, CL_MEM_WRITE_ONLY, format, width, height);
-
-            m_queue[0].enqueueWriteImage(m_inputImage, CL_TRUE, origin, region, rowPitch, slicePitch, &imgPiece[0], nullptr, &m_writeEvent);
-            m_writeEvent.wait();
-            auto startTime = m_writeEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-            auto endTime = m_writeEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-            m_writeTime += (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
-
-            m_kernel.setArg(0, m_inputImage);
-            m_kernel.setArg(1, m_outputImage);
-            m_kernel.setArg(2, BW);
-            m_queue[0].enqueueNDRangeKernel(m_kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange, nullptr, &m_kernelEvents[0]);
-            m_queue[0].finish();
+            // Device without rows gets no launch
+            if (queueParts[i].height == 0)
+                continue;
+            inputs[i] = acquireTileMemory(queueParts[i], true, i);
+            outputs[i] = acquireTileMemory(queueParts[i], false, i);
 
-            cl::Event::waitForEvents(m_kernelEvents);
-            startTime = m_kernelEvents[0].getProfilingInfo<CL_PROFILING_COMMAND_START>();
-            endTime = m_kernelEvents[0].getProfilingInfo<CL_PROFILING_COMMAND_END>();
-            m_kernelNDRangeTimes[0] += (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
+            enqueueWriteTile(m_queue[i], queueParts[i], inputs[i], CL_FALSE, &writeEvents[i]);
+            traceCommand(m_queue[i], "write", queueParts[i], &writeEvents[i]);
+            setKernelArgs(m_deviceKernels[i], inputs[i], outputs[i], m_deviceColors[i], queueParts[i]);
+            enqueueTileKernel(i, queueParts[i], nullptr, &m_kernelEvents[i]);
+            traceCommand(m_queue[i], "kernel", queueParts[i], &m_kernelEvents[i]);
+            mappedPtrs[i] = enqueueReadTile(m_queue[i], queueParts[i], outputs[i], CL_FALSE, nullptr, &readEvents[i]);
+            traceCommand(m_queue[i], "read", queueParts[i], &readEvents[i]);
+            m_queue[i].flush();
+        }
 
-            size_t resultsSize = width * height * 4;
-            unsigned char *p = new unsigned char[resultsSize];
+        // Host rows are processed while devices work, rows of devices aren't touched
+        cl_double hostTime = 0;
+        if (hostRows > 0)
+        {
+            Tracer::Span span(m_tracer, "host part");
+            auto startTime = std::chrono::high_resolution_clock::now();
+            size_t offset = getTileOffset(hostPart);
+            m_hostEngine.maskToImage(&m_imgSource[offset], m_resultsData + offset, hostPart.width, hostPart.height, m_imgSize.x * 4, BW);
+            auto endTime = std::chrono::high_resolution_clock::now();
+            hostTime = std::chrono::duration<cl_double, std::milli>(endTime - startTime).count();
+            if (m_profiling)
+                m_kernelNDRangeTimes[queuesCount] += hostTime;
+        }
 
-            m_queue[0].enqueueReadImage(m_outputImage, CL_TRUE, origin, region, rowPitch, slicePitch, p, nullptr, &m_readEvent);
-            m_readEvent.wait();
-            startTime = m_readEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-            endTime = m_readEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-            m_readTime += (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
-            glueImage(xOffset, yOffset, width, height, p);
+        for (size_t i = 0; i < queuesCount; ++i)
+        {
+            if (queueParts[i].height == 0)
+                continue;
+            readEvents[i].wait();
+            times[i] = getEventTime(m_kernelEvents[i]);
+            m_writeTime += getEventTime(writeEvents[i]);
+            m_kernelNDRangeTimes[i] += times[i];
+            m_readTime += getEventTime(readEvents[i]);
+            devicesTime = std::max(devicesTime, getEventsSpan(writeEvents[i], readEvents[i]));
+            finishReadTile(m_queue[i], outputs[i], mappedPtrs[i]);
+            m_queue[i].finish();
 
-            delete [] p;
+            releaseTileMemory(inputs[i]);
+            releaseTileMemory(outputs[i]);
+        }
+        if (m_adaptiveRatio)
+        {
+            if (hasCPUQueue)
+                updateRatio(times[0], cpuRows, times[1], gpuRows);
+            // Devices work in parallel, so their part is ready when the slowest one finishes
+            if (hostParticipating)
+                updateHostShare(hostTime, hostRows, devicesTime, devicesRows);
         }
     }
 }
 
-void OpenCLWrapper::runOnCombo()
+void OpenCLWrapper::runOnOneDevicePipelined()
 {
-    cl::size_t<3> origin;
-    cl::size_t<3> region;
-    size_t rowPitch = 0;
-    size_t slicePitch = 0;
-    int xNumberOfPieces = m_imgSize.x / m_xPieceSize;
-    int yNumberOfPieces = m_imgSize.y / m_yPieceSize;
-    xNumberOfPieces = (m_imgSize.x % m_xPieceSize) ? xNumberOfPieces + 1 : xNumberOfPieces;
-    yNumberOfPieces = (m_imgSize.y % m_yPieceSize) ? yNumberOfPieces + 1 : yNumberOfPieces;
-    m_kernelEvents.resize(2);
-    m_kernelNDRangeTimes.resize(2, 0);
-    origin[0] = 0; origin[1] = 0; origin[2] = 0;
-    cl::ImageFormat format(CL_RGBA, CL_UNORM_INT8); // structure to define image description
+    m_kernelNDRangeTimes.resize(1, 0);
 
-    for (int x = 0; x < xNumberOfPieces; ++x)
+    // Transfers go to their own queues, so they can overlap with kernel in m_queue[0]
+    if (m_uploadQueue() == nullptr)
+        m_uploadQueue = cl::CommandQueue(m_context, m_devices[0], getQueueProperties());
+    if (m_downloadQueue() == nullptr)
+        m_downloadQueue = cl::CommandQueue(m_context, m_devices[0], getQueueProperties());
+
+    auto tiles = splitIntoTiles(m_xPieceSize, m_yPieceSize);
+    std::vector<cl::Event> writeEvents(tiles.size());
+    std::vector<cl::Event> kernelEvents(tiles.size());
+    std::vector<cl::Event> readEvents(tiles.size());
+    std::vector<TileMemory> inputs(PIPELINE_DEPTH);
+    std::vector<TileMemory> outputs(PIPELINE_DEPTH);
+    std::vector<void *> mappedPtrs(PIPELINE_DEPTH);
+
+    for (size_t i = 0; i < tiles.size() + PIPELINE_DEPTH; ++i)
     {
-        auto width = m_xPieceSize; auto height = m_yPieceSize;
-        for (int y = 0; y < yNumberOfPieces; ++y)
+        // Tile which used the current slot has to be read back before the slot is reused
+        if (i >= PIPELINE_DEPTH)
         {
-            auto xOffset = x*m_xPieceSize;
-            auto yOffset = y*m_yPieceSize;
-            width = ((xOffset + width) > m_imgSize.x) ? (m_imgSize.x - xOffset) : width;
-            height = ((yOffset + height) > m_imgSize.y) ? (m_imgSize.y - yOffset) : height;
-
-            // CPU
-            region[0] = width; region[1] = height; region[2] = 1;
-
-            auto imgPiece = splitImage(xOffset, yOffset, width, height);
-            // Allocate input_image
-            m_inputImage = cl::Image2D(m_context, CL_MEM_READ_ONLY, format, width, height);
-            // Allocate non-initialized output buffer
-            m_outputImage = cl::Image2D(m_context, CL_MEM_WRITE_ONLY, format, width, height);
-            m_queue[0].enqueueWriteImage(m_inputImage, CL_TRUE, origin, region, rowPitch, slicePitch, &imgPiece[0], nullptr, &m_writeEvent);
-            m_writeEvent.wait();
-            auto startTime = m_writeEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-            auto endTime = m_writeEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-            m_writeTime += (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
-
-            m_kernel.setArg(0, m_inputImage);
-            m_kernel.setArg(1, m_outputImage);
-            m_kernel.setArg(2, BLUE);
-            auto ySize = height * (1 - m_NDRangeRatio);
-            m_queue[0].enqueueNDRangeKernel(m_kernel, cl::NullRange, cl::NDRange(width, ySize), cl::NullRange, nullptr, &m_kernelEvents[0]);
-
-            // GPU
-            m_kernel.setArg(0, m_inputImage);
-            m_kernel.setArg(1, m_outputImage);
-            m_kernel.setArg(2, RED);
-            auto gpuYOffset = ySize;
-            ySize = height * m_NDRangeRatio;
-            m_queue[1].enqueueNDRangeKernel(m_kernel, cl::NDRange(0, gpuYOffset), cl::NDRange(width, ySize), cl::NullRange, nullptr, &m_kernelEvents[1]);
-            m_queue[0].finish();
-            m_queue[1].finish();
+            auto done = i - PIPELINE_DEPTH;
+            auto doneSlot = done % PIPELINE_DEPTH;
+            readEvents[done].wait();
+            finishReadTile(m_downloadQueue, outputs[doneSlot], mappedPtrs[doneSlot]);
+            releaseTileMemory(inputs[doneSlot]);
+            releaseTileMemory(outputs[doneSlot]);
+        }
+        if (i >= tiles.size())
+            continue;
+
+        auto &tile = tiles[i];
+        auto slot = i % PIPELINE_DEPTH;
+
+        inputs[slot] = acquireTileMemory(tile, true, 0);
+        outputs[slot] = acquireTileMemory(tile, false, 0);
+
+        enqueueWriteTile(m_uploadQueue, tile, inputs[slot], CL_FALSE, &writeEvents[i]);
+        traceCommand(m_uploadQueue, "write", tile, &writeEvents[i]);
+
+        std::vector<cl::Event> kernelWaitList = { writeEvents[i] };
+        setKernelArgs(m_deviceKernels[0], inputs[slot], outputs[slot], m_deviceColors[0], tile);
+        enqueueTileKernel(0, tile, &kernelWaitList, &kernelEvents[i]);
+        traceCommand(m_queue[0], "kernel", tile, &kernelEvents[i]);
+
+        std::vector<cl::Event> readWaitList = { kernelEvents[i] };
+        mappedPtrs[slot] = enqueueReadTile(m_downloadQueue, tile, outputs[slot], CL_FALSE, &readWaitList, &readEvents[i]);
+        traceCommand(m_downloadQueue, "read", tile, &readEvents[i]);
+
+        m_uploadQueue.flush();
+        m_queue[0].flush();
+        m_downloadQueue.flush();
+    }
+    m_downloadQueue.finish();
+
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        m_writeTime += getEventTime(writeEvents[i]);
+        m_kernelNDRangeTimes[0] += getEventTime(kernelEvents[i]);
+        m_readTime += getEventTime(readEvents[i]);
+    }
+}
+
+void OpenCLWrapper::runOnHost()
+{
+    m_kernelNDRangeTimes.resize(1, 0);
+    m_kernelNDRangeNames = { "Host" };
+    auto startTime = std::chrono::high_resolution_clock::now();
+    m_hostEngine.maskToImage(m_imgSource.data(), m_resultsData, m_imgSize.x, m_imgSize.y, m_imgSize.x * 4, BW);
+    auto endTime = std::chrono::high_resolution_clock::now();
+    if (m_profiling)
+        m_kernelNDRangeTimes[0] += std::chrono::duration<cl_double, std::milli>(endTime - startTime).count();
+}
+
+void OpenCLWrapper::updateRatio(cl_double cpuTime, size_t cpuRows, cl_double gpuTime, size_t gpuRows)
+{
+    // Speed of dropped device is unknown, so the ratio stays as is
+    if (cpuRows == 0 || gpuRows == 0 || cpuTime <= 0 || gpuTime <= 0)
+        return;
+
+    // Both devices finish at the same time when rows are split in proportion to their speeds
+    cl_double cpuSpeed = cpuRows / cpuTime;
+    cl_double gpuSpeed = gpuRows / gpuTime;
+    cl_double balancedRatio = gpuSpeed / (cpuSpeed + gpuSpeed);
+
+    m_NDRangeRatio += RATIO_DAMPING * (balancedRatio - m_NDRangeRatio);
+    if (m_NDRangeRatio < RATIO_MIN_SHARE)
+        m_NDRangeRatio = 0.0;
+    else if (m_NDRangeRatio > 1.0 - RATIO_MIN_SHARE)
+        m_NDRangeRatio = 1.0;
+}
+
+cl_double OpenCLWrapper::getProbedShare(cl_double share, size_t &tilesSinceProbe)
+{
+    if (!m_adaptiveRatio || (share > 0.0 && share < 1.0))
+    {
+        // The next probe is after the full interval since the drop
+        tilesSinceProbe = 1;
+        return share;
+    }
+    // Dropped participant gets the minimal share from time to time, ratio stays as is if it's still slow
+    if (tilesSinceProbe++ % RATIO_PROBE_INTERVAL != 0)
+        return share;
+    return (share == 0.0) ? RATIO_MIN_SHARE : 1.0 - RATIO_MIN_SHARE;
+}
+
+void OpenCLWrapper::setHostShare(cl_double share)
+{
+    m_hostShare = (share >= 0.0 && share <= 1.0) ? share : HOST_SHARE;
+}
+
+bool OpenCLWrapper::isHostParticipating()
+{
+    return m_hostParticipant && m_hostKernelAvailable && m_deviceType == CL_DEVICE_TYPE_ALL && !m_dynamicScheduling;
+}
+
+void OpenCLWrapper::updateHostShare(cl_double hostTime, size_t hostRows, cl_double devicesTime, size_t devicesRows)
+{
+    // The same balancing as between CPU and GPU, devices together are the other participant
+    if (hostRows == 0 || devicesRows == 0 || hostTime <= 0 || devicesTime <= 0)
+        return;
+
+    cl_double hostSpeed = hostRows / hostTime;
+    cl_double devicesSpeed = devicesRows / devicesTime;
+    cl_double balancedShare = hostSpeed / (hostSpeed + devicesSpeed);
+
+    m_hostShare += RATIO_DAMPING * (balancedShare - m_hostShare);
+    if (m_hostShare < RATIO_MIN_SHARE)
+        m_hostShare = 0.0;
+    else if (m_hostShare > 1.0 - RATIO_MIN_SHARE)
+        m_hostShare = 1.0;
+}
+
+bool OpenCLWrapper::loadRatio(std::string fileName)
+{
+    std::ifstream ratioFile(fileName);
+    if (!ratioFile.is_open())
+        return false;
+
+    cl_double ratio = -1;
+    ratioFile >> ratio;
+    if (ratioFile.fail() || ratio < 0.0 || ratio > 1.0)
+        return false;
+
+    m_NDRangeRatio = ratio;
+    return true;
+}
+
+void OpenCLWrapper::saveRatio(std::string fileName)
+{
+    std::ofstream ratioFile(fileName);
+    if (!ratioFile.is_open())
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Cannot open " + fileName + " with writing access!").c_str());
+
+    ratioFile << m_NDRangeRatio << std::endl;
+}
+
+void OpenCLWrapper::partitionCPUDevices()
+{
+    std::vector<cl::Device> devices;
+    for (auto &device : m_devices)
+    {
+        if (device.getInfo<CL_DEVICE_TYPE>() != CL_DEVICE_TYPE_CPU)
+        {
+            devices.push_back(device);
+            continue;
+        }
+        cl_uint computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() / m_cpuSubDevices;
+        if (computeUnits == 0)
+        {
+            devices.push_back(device);
+            continue;
+        }
+        const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, computeUnits, 0 };
+        std::vector<cl::Device> subDevices;
+        device.createSubDevices(properties, &subDevices);
+        devices.insert(devices.end(), subDevices.begin(), subDevices.end());
+    }
+    m_devices = devices;
+}
+
+void OpenCLWrapper::runDynamic()
+{
+    auto tileWidth = std::min(m_schedulingTileWidth, m_tilingPlan.maxTileWidth);
+    auto tileHeight = std::max<size_t>(std::min(std::min(m_schedulingTileHeight, m_tilingPlan.maxTileHeight), m_tilingPlan.maxTilePixels / tileWidth), 1);
+    auto tiles = splitIntoTiles(tileWidth, tileHeight);
+    m_kernelNDRangeTimes.resize(m_queue.size(), 0);
+    m_deviceTiles.resize(m_queue.size(), 0);
+    m_kernelNDRangeNames.clear();
+    for (size_t i = 0; i < m_devices.size(); ++i)
+    {
+        std::ostringstream name;
+        name << "[" << i << "] " << m_devices[i].getInfo<CL_DEVICE_NAME>();
+        m_kernelNDRangeNames.push_back(name.str());
+    }
+
+    // Host thread per device, each of them takes the next tile from the shared counter when its device is idle
+    std::atomic<size_t> nextTile(0);
+    std::atomic<bool> stop(false);
+    std::vector<std::exception_ptr> errors(m_queue.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < m_queue.size(); ++i)
+    {
+        workers.push_back(std::thread([this, i, &tiles, &nextTile, &stop, &errors]()
+        {
+            try
+            {
+                runDynamicWorker(i, tiles, nextTile, stop);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+                stop = true;
+            }
+        }));
+    }
+    for (auto &worker : workers)
+        worker.join();
+    for (auto &error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
+
+void OpenCLWrapper::runDynamicWorker(size_t deviceIndex, const std::vector<Tile> &tiles, std::atomic<size_t> &nextTile, std::atomic<bool> &stop)
+{
+    auto &queue = m_queue[deviceIndex];
+    auto &kernel = m_deviceKernels[deviceIndex];
+    int color = m_deviceColors[deviceIndex];
+    cl_double writeTime = 0;
+    cl_double kernelTime = 0;
+    cl_double readTime = 0;
+    size_t tilesCount = 0;
+
+    for (size_t i = nextTile++; i < tiles.size() && !stop; i = nextTile++)
+    {
+        auto &tile = tiles[i];
+        cl::Event writeEvent;
+        cl::Event kernelEvent;
+        cl::Event readEvent;
+        TileMemory input;
+        TileMemory output;
+        {
+            std::lock_guard<std::mutex> lock(m_schedulingMutex);
+            input = acquireTileMemory(tile, true, deviceIndex);
+            output = acquireTileMemory(tile, false, deviceIndex);
+        }
+
+        enqueueWriteTile(queue, tile, input, CL_FALSE, &writeEvent);
+        traceCommand(queue, "write", tile, &writeEvent);
+        setKernelArgs(kernel, input, output, color, tile);
+        enqueueTileKernel(deviceIndex, tile, nullptr, &kernelEvent);
+        traceCommand(queue, "kernel", tile, &kernelEvent);
+        auto mappedPtr = enqueueReadTile(queue, tile, output, CL_TRUE, nullptr, &readEvent);
+        traceCommand(queue, "read", tile, &readEvent);
+        finishReadTile(queue, output, mappedPtr);
+        queue.finish();
+
+        writeTime += getEventTime(writeEvent);
+        kernelTime += getEventTime(kernelEvent);
+        readTime += getEventTime(readEvent);
+        ++tilesCount;
+
+        std::lock_guard<std::mutex> lock(m_schedulingMutex);
+        releaseTileMemory(input);
+        releaseTileMemory(output);
+    }
+
+    std::lock_guard<std::mutex> lock(m_schedulingMutex);
+    m_writeTime += writeTime;
+    m_kernelNDRangeTimes[deviceIndex] += kernelTime;
+    m_readTime += readTime;
+    m_deviceTiles[deviceIndex] += tilesCount;
+}
+
+cl_command_queue_properties OpenCLWrapper::getQueueProperties()
+{
+    return m_profiling ? CL_QUEUE_PROFILING_ENABLE : 0;
+}
+
+void OpenCLWrapper::traceCommand(const cl::CommandQueue &queue, const std::string &name, const Tile &tile, const cl::Event *event, bool halo)
+{
+    if (!m_profiling || !m_tracer.isEnabled())
+        return;
+    // Zero-copy transfers don't move data, so only kernels are counted as traffic for them.
+    // Inputs are RGBA tiles with the convolution halo, results are tiles in the output format
+    size_t bytes = 0;
+    if (name == "read")
+        bytes = isZeroCopy() ? 0 : tile.width * tile.height * m_outputBytesPerPixel;
+    else if (name != "write" || !isZeroCopy())
+    {
+        auto inputTile = halo ? getInputTile(tile) : tile;
+        bytes = inputTile.width * inputTile.height * 4;
+    }
+    auto deviceName = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_NAME>();
+    m_tracer.addCommand(queue(), deviceName, name, tile.xOffset, tile.yOffset, tile.width, tile.height, bytes, *event);
+}
+
+void OpenCLWrapper::exportTrace(std::string fileName)
+{
+    m_tracer.exportChromeTrace(fileName);
+}
+
+ImageStatistics OpenCLWrapper::computeStatistics()
+{
+    Tracer::Span span(m_tracer, "statistics");
+    if (m_hostEngineUsed)
+        throw cl::Error(OCL_HOST_UNSUPPORTED, "Error! Statistics aren't supported by host engine!");
+    if (m_statisticsKernels.size() != m_queue.size())
+    {
+        m_statisticsKernels.clear();
+        for (size_t i = 0; i < m_queue.size(); ++i)
+            m_statisticsKernels.push_back(cl::Kernel(getDeviceProgram(i, m_source, ""), "imageStatistics"));
+    }
+
+    // Every queue accumulates statistics of its tiles in its own small buffer
+    auto initialValues = ImageStatistics::getDeviceInitialValues();
+    std::vector<cl::Buffer> deviceStatistics;
+    for (auto &queue : m_queue)
+    {
+        deviceStatistics.push_back(cl::Buffer(m_context, CL_MEM_READ_WRITE, initialValues.size() * sizeof(cl_uint)));
+        queue.enqueueWriteBuffer(deviceStatistics.back(), CL_FALSE, 0, initialValues.size() * sizeof(cl_uint), &initialValues[0]);
+    }
+
+    size_t nextQueue = 0;
+    for (auto &tile : splitIntoTiles(m_xPieceSize, m_yPieceSize))
+    {
+        // Rows are split by ratio in combo mode, otherwise tiles go to queues in turn
+        std::vector<Tile> parts(m_queue.size(), { tile.xOffset, tile.yOffset, tile.width, 0 });
+        if (m_queue.size() == 2 && !m_dynamicScheduling)
+        {
+            size_t cpuRows = tile.height * (1 - m_NDRangeRatio);
+            parts[0].height = cpuRows;
+            parts[1] = { tile.xOffset, tile.yOffset + cpuRows, tile.width, tile.height - cpuRows };
+        }
+        else
+        {
+            parts[nextQueue].height = tile.height;
+            nextQueue = (nextQueue + 1) % m_queue.size();
+        }
+
+        std::vector<TileMemory> inputs(m_queue.size());
+        for (size_t i = 0; i < m_queue.size(); ++i)
+        {
+            if (parts[i].height == 0)
+                continue;
+            cl::Event writeEvent;
+            cl::Event kernelEvent;
+            inputs[i] = acquireTileMemory(parts[i], OpenCLBackend::Buffer, CL_MEM_READ_ONLY, m_imgSource.data(), m_imageFormat, 4);
+            enqueueWriteRegion(m_queue[i], parts[i], inputs[i], CL_FALSE, &writeEvent);
+            traceCommand(m_queue[i], "write", parts[i], &writeEvent, false);
+            auto &kernel = m_statisticsKernels[i];
+            kernel.setArg(0, inputs[i].buffer);
+            kernel.setArg(1, (cl_int)parts[i].width);
+            kernel.setArg(2, (cl_int)(getTileRowPitch(parts[i]) / 4));
+            kernel.setArg(3, (cl_int)parts[i].height);
+            kernel.setArg(4, deviceStatistics[i]);
+            // Local histogram and reductions are sized for fixed work-group
+            cl::NDRange globalRange(LocalSizeTuner::padGlobalSize(parts[i].width, STATISTICS_GROUP_SIZE), LocalSizeTuner::padGlobalSize(parts[i].height, STATISTICS_GROUP_SIZE));
+            m_queue[i].enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, cl::NDRange(STATISTICS_GROUP_SIZE, STATISTICS_GROUP_SIZE), nullptr, &kernelEvent);
+            traceCommand(m_queue[i], "statistics", parts[i], &kernelEvent, false);
+            m_queue[i].flush();
+        }
+        for (size_t i = 0; i < m_queue.size(); ++i)
+        {
+            if (parts[i].height == 0)
+                continue;
+            m_queue[i].finish();
+            releaseTileMemory(inputs[i]);
+        }
+    }
+
+    // Only small results are read back and merged
+    ImageStatistics statistics;
+    std::vector<cl_uint> values(initialValues.size());
+    for (size_t i = 0; i < m_queue.size(); ++i)
+    {
+        m_queue[i].enqueueReadBuffer(deviceStatistics[i], CL_TRUE, 0, values.size() * sizeof(cl_uint), &values[0]);
+        statistics.merge(values);
+    }
+    return statistics;
+}
+
+void OpenCLWrapper::printTilingPlan()
+{
+    // Host engine doesn't split image into tiles
+    if (m_hostEngineUsed)
+        return;
+    TilingPlanner::print(m_tilingPlan);
+}
+
+std::vector<OpenCLWrapper::Tile> OpenCLWrapper::splitIntoTiles(size_t tileWidth, size_t tileHeight)
+{
+    std::vector<Tile> tiles;
+    for (size_t xOffset = 0; xOffset < (size_t)m_imgSize.x; xOffset += tileWidth)
+    {
+        for (size_t yOffset = 0; yOffset < (size_t)m_imgSize.y; yOffset += tileHeight)
+        {
+            auto width = std::min(tileWidth, m_imgSize.x - xOffset);
+            auto height = std::min(tileHeight, m_imgSize.y - yOffset);
+            tiles.push_back({ xOffset, yOffset, width, height });
+        }
+    }
+    return tiles;
+}
 
-            cl::Event::waitForEvents(m_kernelEvents);
-            startTime = m_kernelEvents[0].getProfilingInfo<CL_PROFILING_COMMAND_START>();
-            endTime = m_kernelEvents[0].getProfilingInfo<CL_PROFILING_COMMAND_END>();
-            m_kernelNDRangeTimes[0] += (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
+cl_double OpenCLWrapper::getEventsSpan(const cl::Event &first, const cl::Event &last)
+{
+    if (!m_profiling)
+        return 0;
+    // Both events are in the same queue, so their times are in the same device clock
+    auto startTime = first.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+    auto endTime = last.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    return (endTime > startTime) ? (cl_double)(endTime - startTime)*(cl_double)(1e-06) : 0;
+}
 
-            startTime = m_kernelEvents[1].getProfilingInfo<CL_PROFILING_COMMAND_START>();
-            endTime = m_kernelEvents[1].getProfilingInfo<CL_PROFILING_COMMAND_END>();
-            m_kernelNDRangeTimes[1] += (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
+cl_double OpenCLWrapper::getEventTime(const cl::Event &event)
+{
+    if (!m_profiling)
+        return 0;
+    auto startTime = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    auto endTime = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    return (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
+}
+
+size_t OpenCLWrapper::getTileOffset(const Tile &tile, size_t bytesPerPixel)
+{
+    return (tile.yOffset * m_imgSize.x + tile.xOffset) * bytesPerPixel;
+}
+
+size_t OpenCLWrapper::getTileRowPitch(const Tile &tile, size_t bytesPerPixel)
+{
+    // Memory over host image has pitch of the whole image, device memory has packed rows
+    return (isZeroCopy() ? m_imgSize.x : tile.width) * bytesPerPixel;
+}
 
-            size_t resultsSize = width * height * 4;
-            unsigned char *p = new unsigned char[resultsSize];
+OpenCLWrapper::TileMemory OpenCLWrapper::acquireTileMemory(const Tile &tile, bool isInput, size_t deviceIndex)
+{
+    auto backend = m_deviceBackends[deviceIndex];
+    cl_mem_flags flags = isInput ? CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY;
+    // Input of convolution covers the tile with its halo
+    if (isInput)
+        return acquireTileMemory(getInputTile(tile), backend, flags, m_imgSource.data(), m_deviceImageFormats[deviceIndex], 4);
+    return acquireTileMemory(tile, backend, flags, m_resultsData, getOutputImageFormat(deviceIndex), m_outputBytesPerPixel);
+}
+
+OpenCLWrapper::TileMemory OpenCLWrapper::acquireTileMemory(const Tile &tile, OpenCLBackend backend, cl_mem_flags flags, unsigned char *hostImg,
+                                                         const cl::ImageFormat &format, size_t bytesPerPixel)
+{
+    TileMemory memory;
+    memory.backend = backend;
+    if (isZeroCopy())
+    {
+        // Memory object is placed right over the tile of the host image, device works with host memory directly
+        auto hostPtr = hostImg + getTileOffset(tile, bytesPerPixel);
+        size_t rowPitch = getTileRowPitch(tile, bytesPerPixel);
+        // Objects are cached by the pool, the same tile of the same host buffer isn't created again
+        if (backend == OpenCLBackend::Buffer)
+            memory.buffer = m_imagePool.acquireHostBuffer(flags, (tile.height - 1) * rowPitch + tile.width * bytesPerPixel, hostPtr);
+        else
+            memory.image = m_imagePool.acquireHostImage(flags, format, tile.width, tile.height, rowPitch, hostPtr);
+        return memory;
+    }
+    if (backend == OpenCLBackend::Buffer)
+        memory.buffer = m_imagePool.acquireBuffer(flags, tile.width * tile.height * bytesPerPixel);
+    else
+        memory.image = m_imagePool.acquireImage(flags, format, tile.width, tile.height);
+    return memory;
+}
+
+void OpenCLWrapper::releaseTileMemory(const TileMemory &memory)
+{
+    // Memory over host image can't be reused for other tiles, it stays cached for the same tile
+    if (isZeroCopy())
+        return;
+    if (memory.backend == OpenCLBackend::Buffer)
+        m_imagePool.releaseBuffer(memory.buffer);
+    else
+        m_imagePool.releaseImage(memory.image);
+}
 
-            m_queue[0].enqueueReadImage(m_outputImage, CL_TRUE, origin, region, rowPitch, slicePitch, p, nullptr, &m_readEvent);
-            m_readEvent.wait();
-            startTime = m_readEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-            endTime = m_readEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-            m_readTime += (cl_double)(endTime - startTime)*(cl_double)(1e-06); // From nano seconds to milli
-            glueImage(xOffset, yOffset, width, height, p);
+void OpenCLWrapper::enqueueWriteTile(const cl::CommandQueue &queue, const Tile &tile, const TileMemory &memory, cl_bool blocking, cl::Event *event)
+{
+    enqueueWriteRegion(queue, getInputTile(tile), memory, blocking, event);
+}
 
-            delete [] p;
+void OpenCLWrapper::enqueueWriteRegion(const cl::CommandQueue &queue, const Tile &tile, const TileMemory &memory, cl_bool blocking, cl::Event *event)
+{
+    cl::size_t<3> origin;
+    cl::size_t<3> region;
+    origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    region[0] = tile.width; region[1] = tile.height; region[2] = 1;
+    if (isZeroCopy())
+    {
+        // Cached memory object is reused for new contents of host memory, map and unmap make them visible
+        // to device without a copy (the mapped pointer is the host one)
+        void *mappedPtr = nullptr;
+        if (memory.backend == OpenCLBackend::Buffer)
+        {
+            mappedPtr = queue.enqueueMapBuffer(memory.buffer, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, 0, memory.buffer.getInfo<CL_MEM_SIZE>());
+            queue.enqueueUnmapMemObject(memory.buffer, mappedPtr, nullptr, event);
+        }
+        else
+        {
+            size_t mappedRowPitch = 0;
+            size_t mappedSlicePitch = 0;
+            mappedPtr = queue.enqueueMapImage(memory.image, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, origin, region, &mappedRowPitch, &mappedSlicePitch);
+            queue.enqueueUnmapMemObject(memory.image, mappedPtr, nullptr, event);
         }
+        if (blocking)
+            event->wait();
+        return;
+    }
+    // Row pitch of the whole host image lets to copy the tile without splitting
+    size_t rowPitch = m_imgSize.x * 4;
+    size_t slicePitch = 0;
+    if (memory.backend == OpenCLBackend::Buffer)
+    {
+        // Region of buffer copy is in bytes
+        region[0] = tile.width * 4;
+        queue.enqueueWriteBufferRect(memory.buffer, blocking, origin, origin, region, getTileRowPitch(tile), 0, rowPitch, slicePitch, &m_imgSource[getTileOffset(tile)], nullptr, event);
+        return;
     }
+    queue.enqueueWriteImage(memory.image, blocking, origin, region, rowPitch, slicePitch, &m_imgSource[getTileOffset(tile)], nullptr, event);
 }
 
-std::vector<unsigned char> OpenCLWrapper::splitImage(int xOffset, int yOffset, int width, int height)
+void *OpenCLWrapper::enqueueReadTile(const cl::CommandQueue &queue, const Tile &tile, const TileMemory &memory, cl_bool blocking, const std::vector<cl::Event> *waitList, cl::Event *event)
 {
-    std::vector<unsigned char> img;
-    img.resize(width * height * 4 * sizeof(unsigned char));
-    for (int row = 0; row < height; ++row)
+    cl::size_t<3> origin;
+    cl::size_t<3> region;
+    origin[0] = 0; origin[1] = 0; origin[2] = 0;
+    region[0] = tile.width; region[1] = tile.height; region[2] = 1;
+    size_t rowPitch = m_imgSize.x * m_outputBytesPerPixel;
+    size_t slicePitch = 0;
+    auto hostPtr = m_resultsData + getTileOffset(tile, m_outputBytesPerPixel);
+    if (memory.backend == OpenCLBackend::Buffer)
+    {
+        if (isZeroCopy())
+            return queue.enqueueMapBuffer(memory.buffer, blocking, CL_MAP_READ, 0, (tile.height - 1) * rowPitch + tile.width * m_outputBytesPerPixel, waitList, event);
+        region[0] = tile.width * m_outputBytesPerPixel;
+        queue.enqueueReadBufferRect(memory.buffer, blocking, origin, origin, region, getTileRowPitch(tile, m_outputBytesPerPixel), 0, rowPitch, slicePitch, hostPtr, waitList, event);
+        return nullptr;
+    }
+    if (isZeroCopy())
     {
-        auto destIndex = row * width * 4;
-        auto srcIndex = xOffset * 4 + (yOffset + row) * m_imgSize.x * 4;
-        auto count = width * 4;
-        memcpy(&img[destIndex], &m_imgSource[srcIndex], count);
+        // Mapping of image created with CL_MEM_USE_HOST_PTR synchronizes results in host memory without copy
+        return queue.enqueueMapImage(memory.image, blocking, CL_MAP_READ, origin, region, &rowPitch, &slicePitch, waitList, event);
     }
-    return img;
+    queue.enqueueReadImage(memory.image, blocking, origin, region, rowPitch, slicePitch, hostPtr, waitList, event);
+    return nullptr;
 }
 
-void OpenCLWrapper::glueImage(int xOffset, int yOffset, int width, int height, unsigned char *p)
+void OpenCLWrapper::finishReadTile(const cl::CommandQueue &queue, const TileMemory &memory, void *mappedPtr)
 {
-    for (int row = 0; row < height; ++row)
+    if (mappedPtr == nullptr)
+        return;
+    if (memory.backend == OpenCLBackend::Buffer)
+        queue.enqueueUnmapMemObject(memory.buffer, mappedPtr);
+    else
+        queue.enqueueUnmapMemObject(memory.image, mappedPtr);
+}
+
+void OpenCLWrapper::setKernelArgs(cl::Kernel &kernel, const TileMemory &input, const TileMemory &output, int color, const Tile &tile)
+{
+    if (m_convolutionRadius > 0)
+    {
+        // Tile is at (halo.x, halo.y) of the input, halo is narrower at borders of the image
+        auto inputTile = getInputTile(tile);
+        cl_int2 halo = { { (cl_int)(tile.xOffset - inputTile.xOffset), (cl_int)(tile.yOffset - inputTile.yOffset) } };
+        size_t blockSide = CONVOLUTION_GROUP_SIZE + 2 * m_convolutionRadius;
+        kernel.setArg(0, input.image);
+        kernel.setArg(1, output.image);
+        kernel.setArg(2, m_convolutionWeights);
+        kernel.setArg(3, m_convolutionRadius);
+        kernel.setArg(4, halo);
+        // Block of work-group with apron and result of horizontal pass for all its rows
+        kernel.setArg(5, cl::Local(blockSide * blockSide * sizeof(cl_float4)));
+        kernel.setArg(6, cl::Local(CONVOLUTION_GROUP_SIZE * blockSide * sizeof(cl_float4)));
+        return;
+    }
+    if (input.backend == OpenCLBackend::Buffer)
     {
-        auto destIndex = (yOffset + row) * m_imgSize.x * 4 + xOffset * 4;
-        auto srcIndex = row * width * 4;
-        auto count = width * 4;
-        memcpy(&m_results[destIndex], &p[srcIndex], count);
+        kernel.setArg(0, input.buffer);
+        kernel.setArg(1, output.buffer);
+        kernel.setArg(2, color);
+        // Buffer kernel doesn't know size of tile, so width, row pitch in pixels and height are passed
+        kernel.setArg(3, (cl_int)tile.width);
+        kernel.setArg(4, (cl_int)(getTileRowPitch(tile) / 4));
+        kernel.setArg(5, (cl_int)tile.height);
+        return;
     }
+    kernel.setArg(0, input.image);
+    kernel.setArg(1, output.image);
+    kernel.setArg(2, color);
 }
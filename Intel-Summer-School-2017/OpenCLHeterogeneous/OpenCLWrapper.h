@@ -3,10 +3,24 @@
 
 #define __CL_ENABLE_EXCEPTIONS
 #include <CL/cl.hpp>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
+#include "FilterPipeline.h"
+#include "HostImageEngine.h"
+#include "ImagePool.h"
+#include "ImageStatistics.h"
+#include "LocalSizeTuner.h"
+#include "ProgramCache.h"
+#include "TilingPlanner.h"
+#include "Tracer.h"
 
-enum class OpenCLPlatformType {Intel, AMD};
+enum class OpenCLPlatformType {Intel, AMD, Any, Host};
 enum class OpenCLDeviceType {CPU, GPU, COMBO};
+enum class OpenCLBackend {Image, Buffer};
+enum class ConvolutionType {Gaussian, Box, Sobel};
 
 class OpenCLWrapper
 {
@@ -14,59 +28,448 @@ public:
     OpenCLWrapper();
     virtual ~OpenCLWrapper() = default;
     void setPlatformAndDevice(OpenCLPlatformType, OpenCLDeviceType);
+    /**
+    Use native host engine when no OpenCL platform or device is found.
+    Host engine supports only maskToImage kernel, processes the whole image
+    with SIMD code on all host threads and gives the same results as
+    maskToImageInt. Host platform type always uses it. Enabled by default,
+    should be set before setPlatformAndDevice.
+
+    @param fallback true to use host engine instead of failing.
+    */
+    inline void setHostFallback(bool fallback) { m_hostFallback = fallback; }
+    inline bool isHostEngineUsed() { return m_hostEngineUsed; }
+    inline HostImageEngine &getHostEngine() { return m_hostEngine; }
     void createContextAndQueue();
     void getProgramSourcesFromFile(std::string fileName);
     void getProgramSourcesFromString(std::string src);
+    /**
+    Set directory of on-disk cache for program binaries.
+    When it's set, buildProgram loads binaries from the cache and builds
+    program from source only if they are absent or rejected by runtime.
+
+    @param directory existing directory, empty string disables the cache.
+    */
+    inline void setProgramCacheDir(std::string directory) { m_programCache.setDirectory(directory); }
     void buildProgram(std::string options = "");
     void createInputAndOutputImages(std::vector<unsigned char> &img, cl_int2 imgSize);
+    /**
+    Take the input image without copying.
+    Previous input image is left in img, so the caller can load the next
+    image into its memory.
+
+    @param img RGBA pixels of the image.
+    @param imgSize width and height of the image.
+    */
+    void createInputAndOutputImages(std::vector<unsigned char> &&img, cl_int2 imgSize);
+    /**
+    Get height of strips for processing of the image strip by strip.
+    Input and results of a strip always fit to the given budget. If tiles
+    of the plan for the full image are lower than the strip, the strip is
+    a whole number of their rows, otherwise tiles are planned within the
+    strip. Convolutions need rows of neighbour strips and can't be
+    processed by strips.
+
+    @param imgSize width and height of the whole image.
+    @param maxStripBytes host memory for input and results of one strip.
+    @return number of rows in strip.
+    */
+    size_t getStripHeight(cl_int2 imgSize, size_t maxStripBytes);
+    /**
+    Enable automatic choice of kernel variant.
+    If program has integer variant of the kernel (kernel name with "Int"
+    suffix, it works with CL_UNSIGNED_INT8 images and processes several
+    pixels per work-item), createKernel measures both variants on every
+    device with image backend and each device uses the variant which is
+    faster on it. Enabled by default.
+
+    @param autoSelect true to choose kernel variant by measurement.
+    */
+    inline void setKernelAutoSelect(bool autoSelect) { m_kernelAutoSelect = autoSelect; }
+    /**
+    Set type of device memory for tiles of devices of the given type.
+    Image backend works with image2d_t and sampler, buffer backend works
+    with plain buffers and the kernel with "Buffer" suffix which loads and
+    stores 16 bytes by vload16/vstore16. Buffers are usually faster on CPU
+    runtimes where images are emulated. Should be set before createKernel.
+
+    @param deviceType CPU or GPU, COMBO sets the backend for all devices.
+    @param backend memory type of tiles.
+    */
+    void setBackend(OpenCLDeviceType deviceType, OpenCLBackend backend);
+    /**
+    Enable program variants specialized by color of mask.
+    Program is built for every color used by devices with -DCOLOR=<color>
+    option, so branches on color are folded at build time. Only variants
+    of the colors in use are built, without the generic program. Variants
+    are cached by build options and every device gets a kernel from the
+    variant of its color. Enabled by default, should be set before
+    buildProgram.
+
+    @param specialized true to use specialized program variants.
+    */
+    inline void setSpecializedKernels(bool specialized) { m_specializedKernels = specialized; }
+    /**
+    Store BW results of maskToImage as one byte of gray per pixel.
+    Devices write CL_R images or packed uchar buffers (maskToGray and
+    maskToGrayBuffer kernels), so read back and results are 4 times
+    smaller. Used only when all devices have BW mask (not in heterogeneous
+    mode), getResultBytesPerPixel tells the format of results. Should be
+    set before createKernel.
+
+    @param gray true to store gray results.
+    */
+    inline void setGrayOutput(bool gray) { m_grayOutput = gray; }
+    inline size_t getResultBytesPerPixel() { return m_outputBytesPerPixel; }
+    /**
+    Read results straight to external memory, e.g. pixels of BMP file
+    mapped by CreateMappedBMP, instead of the internal buffer. Tiles are
+    read (or mapped in zero-copy mode) right to their place in the target,
+    so no host copy of results is made. Rows of the target have to be
+    packed like rows of results: width * getResultBytesPerPixel() bytes.
+    Should be set before createInputAndOutputImages. Target has to be
+    reset (or replaced) before its memory is released: results of the
+    image are dropped then and runKernel needs a new image.
+
+    @param pixels memory for results, nullptr to use the internal buffer.
+    */
+    void setResultsTarget(unsigned char *pixels);
     void createKernel(std::string kernelName);
     /**
+    Enable tuning of local work size.
+    On the first launch for every kernel, device and tile shape a few
+    local sizes are measured and the fastest one is stored in the file.
+    Tuned sizes are loaded from the file, so later runs don't measure.
+
+    @param fileName tuning file, empty string disables tuning.
+    */
+    inline void setLocalSizeTuningFile(std::string fileName) { m_localSizeTuner.setFile(fileName); }
+    /**
+    Generate, build and use one fused kernel for all stages of the
+    pipeline instead of createKernel. Generated programs are cached by
+    signature of the pipeline, so the same pipeline is built only once.
+
+    @param pipeline stages of the filter.
+    */
+    void createPipelineKernel(const FilterPipeline &pipeline);
+    /**
+    Use separable convolution instead of createKernel.
+    Each work-group stages its block with apron in local memory and does
+    horizontal and vertical passes there. Input tiles are transferred with
+    a halo of radius pixels, so results of neighbor tiles have no seams.
+    Gaussian uses sigma equal to half of radius, Sobel always has radius 1
+    and gives magnitude of gradient of gray. Convolution always works with
+    images, whatever backend is set.
+
+    @param type filter of convolution.
+    @param radius radius of filter from 1 to 8.
+    */
+    void createConvolutionKernel(ConvolutionType type, cl_int radius);
+    inline std::string getKernelName() { return m_kernelName; }
+    /**
+    Enable measured search of tile shape.
+    On the first run for every image size a few tile shapes which fit to
+    the device limits are measured and the fastest one is used.
+
+    @param autotune true to measure tile shapes.
+    */
+    inline void setTileAutotune(bool autotune) { m_tileAutotune = autotune; }
+    /**
+    Set tile size instead of the planned one. It's still limited by the
+    device limits of the tiling plan.
+
+    @param width width of tile, 0 to use the plan.
+    @param height height of tile, 0 to use the plan.
+    */
+    inline void setTileSize(size_t width, size_t height) { m_tileWidth = width; m_tileHeight = height; }
+    void printTilingPlan();
+    /**
     Set ratio of calculating between CPU and GPU.
-    Value should be in range between 0.1 and 0.9.
+    Value should be in range between 0.0 and 1.0.
     near to 0 - more calculations are on CPU
     near to 1 - more calculations are on GPU
+    0 or 1 - only one device is used
+
+    @param ratio the value in range from 0.0 to 1.0.
+    */
+    inline void setRatio(cl_double ratio) { m_NDRangeRatio = (ratio >= 0.0 && ratio <= 1.0) ? ratio : 0.5; }
+    inline cl_double getRatio() { return m_NDRangeRatio; }
+    /**
+    Enable adaptive ratio between CPU and GPU.
+    After each tile the ratio is moved toward the value at which both
+    devices finish at the same time. The step is damped to avoid
+    oscillation. Device which gets less than a small share of rows is
+    dropped, but every few tiles it gets the small share again to measure
+    its speed, so it comes back after a transient slowdown.
+
+    @param adaptive true to tune ratio during running.
+    */
+    inline void setAdaptiveRatio(bool adaptive) { m_adaptiveRatio = adaptive; }
+    /**
+    Use host threads as one more participant of COMBO mode.
+    Host engine takes its share of rows of every tile while devices
+    process the rest split by ratio, its time is reported together with
+    devices. Without CPU device all device rows go to GPU, so host cores
+    still work. Works only with maskToImage kernel, host part has no mask
+    color. Should be set before createContextAndQueue.
+
+    @param participant true to process a share of rows on host.
+    */
+    inline void setHostParticipant(bool participant) { m_hostParticipant = participant; }
+    /**
+    Set share of rows of every tile which is processed on host.
+    Adaptive ratio tunes it as well.
+
+    @param share the value in range from 0.0 to 1.0.
+    */
+    void setHostShare(cl_double share);
+    inline cl_double getHostShare() { return m_hostShare; }
+    /**
+    Load ratio saved by previous run.
+
+    @param fileName file with saved ratio.
+    @return true if ratio was loaded.
+    */
+    bool loadRatio(std::string fileName);
+    void saveRatio(std::string fileName);
+    /**
+    Enable pipelined execution on one device.
+    Upload of tile N+1, kernel on tile N and read back of tile N-1 are
+    enqueued without blocking to separate queues and chained by events,
+    so transfers overlap with computations.
+
+    @param pipelined true to enable pipeline, false for sequential mode.
+    */
+    inline void setPipelined(bool pipelined) { m_pipelined = pipelined; }
+    /**
+    Allow zero-copy transfers when all devices share memory with host.
+    In this case tile images are created with CL_MEM_USE_HOST_PTR right
+    over the source and results images and read back is done by map/unmap.
+    Enabled by default.
+
+    @param zeroCopy true to allow zero-copy transfers.
+    */
+    inline void setZeroCopy(bool zeroCopy) { m_zeroCopy = zeroCopy; }
+    /**
+    Enable dynamic scheduling for COMBO device type.
+    Image is split into small tiles in a shared work queue and every
+    device, with its own queue and kernel, takes the next tile when it
+    becomes idle. All devices of the platform are used. Should be set
+    before createContextAndQueue.
+
+    @param dynamic true to use dynamic scheduling instead of ratio.
+    */
+    inline void setDynamicScheduling(bool dynamic) { m_dynamicScheduling = dynamic; }
+    /**
+    Set size of tiles in the work queue of dynamic scheduling.
+
+    @param width width of tile in pixels.
+    @param height height of tile in pixels.
+    */
+    inline void setSchedulingTileSize(size_t width, size_t height) { m_schedulingTileWidth = width; m_schedulingTileHeight = height; }
+    /**
+    Split CPU device into equal sub-devices in dynamic scheduling, so each
+    of them pulls tiles on its own. Should be set before createContextAndQueue.
+
+    @param count number of sub-devices, 0 or 1 to keep the whole device.
+    */
+    inline void setCPUSubDevices(cl_uint count) { m_cpuSubDevices = count; }
+    /**
+    Enable or disable profiling of commands.
+    Without profiling queues are created without CL_QUEUE_PROFILING_ENABLE,
+    no times are collected and tracing is off. Adaptive ratio needs
+    profiling. Should be set before createContextAndQueue.
+
+    @param profiling false for low-overhead runs.
+    */
+    inline void setProfiling(bool profiling) { m_profiling = profiling; }
+    /**
+    Record every enqueued command and host spans of the wrapper for
+    export by exportTrace. Works only with enabled profiling.
+
+    @param trace true to record commands.
+    */
+    inline void setTrace(bool trace) { m_tracer.setEnabled(trace); }
+    inline Tracer &getTracer() { return m_tracer; }
+    /**
+    Export recorded commands and host spans as Chrome trace-event JSON.
 
-    @param ratio the value in range from 0.1 to 0.9.
+    @param fileName output JSON file.
     */
-    inline void setRatio(cl_double ratio) { m_NDRangeRatio = (ratio >= 0.1 && ratio <= 0.9) ? ratio : 0.5; }
+    void exportTrace(std::string fileName);
     void runKernel();
-    inline std::vector<unsigned char> getResults() { return m_results; }
+    /**
+    Compute histograms and statistics of the input image on devices.
+    Tiles are processed by all queues (rows are split by ratio in combo
+    mode), every queue accumulates its results on device and only these
+    small results are read back and merged.
+
+    @return statistics of the input image.
+    */
+    ImageStatistics computeStatistics();
+    // Results of the last image without copy, valid until the next image
+    inline const unsigned char *getResultsData() { return m_resultsData; }
+    inline std::vector<unsigned char> getResults() { return std::vector<unsigned char>(m_resultsData, m_resultsData + m_resultsSize); }
     void printTimes();
-    inline std::string getPlatformName() { return m_platform.getInfo<CL_PLATFORM_NAME>(); }
+    inline std::string getPlatformName() { return m_hostEngineUsed ? "Host" : m_platform.getInfo<CL_PLATFORM_NAME>(); }
     std::string getDeviceName();
 protected:
     virtual cl::Platform getIntelOCLPlatform();
     virtual cl::Platform getATIOCLPlatform();
+    virtual cl::Platform getAnyOCLPlatform(cl_device_type deviceType);
     bool isCPUDevicePresented();
     bool isGPUDevicePresented();
 private:
+    cl::Program compileProgram(const cl::Program::Sources &sources, const std::string &options);
+    std::string getVariantOptions(int color);
+    cl::Program getDeviceProgram(size_t deviceIndex, const cl::Program::Sources &sources, const std::string &signature);
+    cl::Program getProgramVariant(const cl::Program::Sources &sources, const std::string &signature, const std::string &options);
+    void setDeviceBackendsAndColors();
+    void createDeviceKernels(const std::string &bufferKernelName, const cl::Program::Sources &sources, const std::string &signature);
+    int getDeviceColor(const cl::CommandQueue &queue);
+    void allocateResults();
+    void planTiles();
+    void setOutputBytesPerPixel(size_t bytesPerPixel);
+    void setDeviceVariants(const std::string &kernelName);
+    bool isImageFormatSupported(const cl::ImageFormat &format, cl_mem_flags flags);
+    cl::ImageFormat getOutputImageFormat(size_t deviceIndex);
+    struct Tile
+    {
+        size_t xOffset;
+        size_t yOffset;
+        size_t width;
+        size_t height;
+    };
+    // Memory of tile on device, only the object of the backend is used
+    struct TileMemory
+    {
+        OpenCLBackend backend;
+        cl::Image2D image;
+        cl::Buffer buffer;
+    };
+    std::vector<Tile> splitIntoTiles(size_t tileWidth, size_t tileHeight);
+    cl_double getEventTime(const cl::Event &event);
+    cl_double getEventsSpan(const cl::Event &first, const cl::Event &last);
+    cl_command_queue_properties getQueueProperties();
+    // Statistics pass halo = false, they read the tile itself even when convolution kernel is created
+    void traceCommand(const cl::CommandQueue &queue, const std::string &name, const Tile &tile, const cl::Event *event, bool halo = true);
+    inline bool isZeroCopy() { return m_zeroCopy && m_hostUnifiedMemory; }
+    size_t getTileOffset(const Tile &tile, size_t bytesPerPixel = 4);
+    size_t getTileRowPitch(const Tile &tile, size_t bytesPerPixel = 4);
+    Tile getInputTile(const Tile &tile);
+    TileMemory acquireTileMemory(const Tile &tile, bool isInput, size_t deviceIndex);
+    TileMemory acquireTileMemory(const Tile &tile, OpenCLBackend backend, cl_mem_flags flags, unsigned char *hostImg, const cl::ImageFormat &format, size_t bytesPerPixel);
+    void releaseTileMemory(const TileMemory &memory);
+    void enqueueWriteTile(const cl::CommandQueue &queue, const Tile &tile, const TileMemory &memory, cl_bool blocking, cl::Event *event);
+    void enqueueWriteRegion(const cl::CommandQueue &queue, const Tile &tile, const TileMemory &memory, cl_bool blocking, cl::Event *event);
+    void *enqueueReadTile(const cl::CommandQueue &queue, const Tile &tile, const TileMemory &memory, cl_bool blocking, const std::vector<cl::Event> *waitList, cl::Event *event);
+    void finishReadTile(const cl::CommandQueue &queue, const TileMemory &memory, void *mappedPtr);
+    void setKernelArgs(cl::Kernel &kernel, const TileMemory &input, const TileMemory &output, int color, const Tile &tile);
+    void selectKernelVariant(std::string kernelName);
+    cl_double measureKernel(size_t deviceIndex, cl::Kernel &kernel, const cl::ImageFormat &format, size_t pixelsPerWorkItem);
+    size_t getGlobalWidth(size_t deviceIndex, size_t width);
+    void enqueueTileKernel(size_t deviceIndex, const Tile &tile, const std::vector<cl::Event> *waitList, cl::Event *event);
+    void tuneTileSize();
     void runOnOneDevice();
+    void runOnOneDevicePipelined();
+    void updateRatio(cl_double cpuTime, size_t cpuRows, cl_double gpuTime, size_t gpuRows);
     void runOnCombo();
-    std::vector<unsigned char> splitImage(int xOffset, int yOffset, int width, int height);
-    void glueImage(int xOffset, int yOffset, int width, int height, unsigned char *p);
+    void partitionCPUDevices();
+    void runDynamic();
+    void runDynamicWorker(size_t deviceIndex, const std::vector<Tile> &tiles, std::atomic<size_t> &nextTile, std::atomic<bool> &stop);
+    void runOnHost();
+    void updateHostShare(cl_double hostTime, size_t hostRows, cl_double devicesTime, size_t devicesRows);
+    bool isHostParticipating();
+    cl_double getProbedShare(cl_double share, size_t &tilesSinceProbe);
+    size_t getTilesInFlight();
     cl::Platform m_platform;
     std::vector<cl::Device> m_devices;
     cl::Context m_context;
     std::vector<cl::CommandQueue> m_queue;
     cl::Program::Sources m_source;
     std::string m_sourceStr;
-    cl::Program m_program;
     std::vector<unsigned char> m_imgSource;
     cl_int2 m_imgSize;
-    cl::Image2D m_inputImage;
-    cl::Image2D m_outputImage;
-    cl::Kernel m_kernel;
+    TileMemory m_inputMemory;
+    TileMemory m_outputMemory;
     std::vector<unsigned char> m_results;
+    // Results are read to the internal buffer or to the target set by user
+    unsigned char *m_resultsTarget;
+    unsigned char *m_resultsData;
+    size_t m_resultsSize;
     cl_device_type m_deviceType;
     cl_double m_NDRangeRatio;
     size_t m_xPieceSize;
     size_t m_yPieceSize;
     std::vector<cl::Event> m_kernelEvents;
     std::vector<cl_double> m_kernelNDRangeTimes;
+    std::vector<std::string> m_kernelNDRangeNames;
     cl::Event m_writeEvent;
     cl_double m_writeTime;
     cl::Event m_readEvent;
     cl_double m_readTime;
+    bool m_pipelined;
+    cl::CommandQueue m_uploadQueue;
+    cl::CommandQueue m_downloadQueue;
+    cl_double m_wallTime;
+    ImagePool m_imagePool;
+    bool m_zeroCopy;
+    bool m_hostUnifiedMemory;
+    bool m_adaptiveRatio;
+    // Tiles since the dropped device got rows for measurement
+    size_t m_ratioProbeTiles;
+    std::string m_kernelName;
+    bool m_dynamicScheduling;
+    size_t m_schedulingTileWidth;
+    size_t m_schedulingTileHeight;
+    cl_uint m_cpuSubDevices;
+    // Kernel and backend of every queue in m_queue, each device gets own arguments
+    std::vector<cl::Kernel> m_deviceKernels;
+    std::vector<OpenCLBackend> m_deviceBackends;
+    std::vector<int> m_deviceColors;
+    // Image kernel variant of every queue, the integer one reads images of another format
+    std::vector<std::string> m_deviceKernelNames;
+    std::vector<cl::ImageFormat> m_deviceImageFormats;
+    std::vector<size_t> m_devicePixelsPerWorkItem;
+    std::vector<size_t> m_deviceTiles;
+    // Guards image pool and times during dynamic scheduling
+    std::mutex m_schedulingMutex;
+    ProgramCache m_programCache;
+    cl_double m_buildTime;
+    TilingPlanner m_tilingPlanner;
+    TilingPlan m_tilingPlan;
+    bool m_tileAutotune;
+    // Measured tile width and height for image width and height
+    std::map<std::pair<size_t, size_t>, std::pair<size_t, size_t>> m_tunedTiles;
+    bool m_profiling;
+    Tracer m_tracer;
+    size_t m_tileWidth;
+    size_t m_tileHeight;
+    cl::ImageFormat m_imageFormat;
+    bool m_kernelAutoSelect;
+    OpenCLBackend m_cpuBackend;
+    OpenCLBackend m_gpuBackend;
+    LocalSizeTuner m_localSizeTuner;
+    bool m_specializedKernels;
+    std::string m_buildOptions;
+    // Specialized and generated programs by signature of generated source and build options
+    std::map<std::string, cl::Program> m_programVariants;
+    // Radius of convolution, 0 for per-pixel kernels
+    cl_int m_convolutionRadius;
+    cl::Buffer m_convolutionWeights;
+    size_t m_processedPixels;
+    std::vector<cl::Kernel> m_statisticsKernels;
+    HostImageEngine m_hostEngine;
+    bool m_hostFallback;
+    bool m_hostEngineUsed;
+    bool m_hostParticipant;
+    cl_double m_hostShare;
+    size_t m_hostProbeTiles;
+    // Host engine can replace only maskToImage, not pipelines and convolutions
+    bool m_hostKernelAvailable;
+    bool m_grayOutput;
+    // Results are gray with 1 byte per pixel, otherwise they have the same format as input
+    size_t m_outputBytesPerPixel;
 };
 
 #endif // OPENCLWRAPPER_H
@@ -0,0 +1,200 @@
+#include "ProgramCache.h"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <set>
+#include <sstream>
+
+// Version of the key and file layout, changing it invalidates all cached binaries
+const int CACHE_VERSION = 2;
+// Depth of nested includes which are hashed with the source
+const int MAX_INCLUDE_DEPTH = 8;
+
+ProgramCache::ProgramCache()
+    : m_hits(0),
+      m_misses(0)
+{ }
+
+cl::Program ProgramCache::build(const cl::Context &context, const std::vector<cl::Device> &devices, const cl::Program::Sources &sources, const std::string &options)
+{
+    std::vector<std::string> keys;
+    std::vector<std::vector<unsigned char>> binaries(devices.size());
+    bool cached = true;
+    for (size_t i = 0; i < devices.size(); ++i)
+    {
+        keys.push_back(getKey(devices[i], sources, options));
+        cached = load(keys.back(), binaries[i]) && cached;
+    }
+
+    if (cached)
+    {
+        try
+        {
+            cl::Program::Binaries programBinaries;
+            for (auto &binary : binaries)
+                programBinaries.push_back({ &binary[0], binary.size() });
+            cl::Program program(context, devices, programBinaries);
+            program.build(devices, options.c_str());
+            ++m_hits;
+            return program;
+        }
+        catch (cl::Error &)
+        {
+            // Binary is rejected by runtime (e.g. driver was updated), it will be rebuilt from source
+        }
+    }
+
+    ++m_misses;
+    cl::Program program(context, sources);
+    program.build(devices, options.c_str());
+
+    // Binaries can't be got by cl::Program::getInfo, because it doesn't allocate memory for them.
+    // They go in the order of CL_PROGRAM_DEVICES, which isn't required to be the order of devices
+    auto programDevices = program.getInfo<CL_PROGRAM_DEVICES>();
+    auto sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    if (sizes.empty() || sizes.size() != programDevices.size())
+        return program;
+    binaries.assign(sizes.size(), std::vector<unsigned char>());
+    std::vector<unsigned char *> pointers;
+    for (size_t i = 0; i < sizes.size(); ++i)
+    {
+        // Device without binary gets null pointer, runtime skips it
+        binaries[i].resize(sizes[i]);
+        pointers.push_back(sizes[i] == 0 ? nullptr : &binaries[i][0]);
+    }
+    cl_int err = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, pointers.size() * sizeof(unsigned char *), &pointers[0], nullptr);
+    if (err != CL_SUCCESS)
+        return program;
+
+    for (size_t i = 0; i < programDevices.size(); ++i)
+    {
+        auto device = std::find_if(devices.begin(), devices.end(), [&](const cl::Device &d) { return d() == programDevices[i](); });
+        if (device != devices.end())
+            save(keys[device - devices.begin()], binaries[i]);
+    }
+    return program;
+}
+
+std::string ProgramCache::getKey(const cl::Device &device, const cl::Program::Sources &sources, const std::string &options)
+{
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    std::ostringstream key;
+    key << CACHE_VERSION << "\n"
+        << platform.getInfo<CL_PLATFORM_NAME>() << "\n"
+        << platform.getInfo<CL_PLATFORM_VERSION>() << "\n"
+        << device.getInfo<CL_DEVICE_NAME>() << "\n"
+        << device.getInfo<CL_DRIVER_VERSION>() << "\n"
+        << options << "\n";
+    std::set<std::string> included;
+    for (auto &source : sources)
+    {
+        std::string text(source.first, source.second);
+        key << text;
+        // Headers are compiled into the binary too, so their changes must invalidate it
+        appendIncludes(text, getIncludeDirectories(options), 0, included, key);
+    }
+    return key.str();
+}
+
+std::vector<std::string> ProgramCache::getIncludeDirectories(const std::string &options)
+{
+    // Runtime searches the current directory and directories of -I options
+    std::vector<std::string> directories = { "." };
+    std::istringstream stream(options);
+    std::string option;
+    while (stream >> option)
+    {
+        if (option == "-I" && stream >> option)
+            directories.push_back(option);
+        else if (option.compare(0, 2, "-I") == 0 && option.size() > 2)
+            directories.push_back(option.substr(2));
+    }
+    return directories;
+}
+
+void ProgramCache::appendIncludes(const std::string &text, const std::vector<std::string> &directories, int depth,
+                                  std::set<std::string> &included, std::ostringstream &key)
+{
+    if (depth >= MAX_INCLUDE_DEPTH)
+        return;
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        auto directive = line.find_first_not_of(" \t");
+        if (directive == std::string::npos || line.compare(directive, 1, "#") != 0 || line.find("include", directive) == std::string::npos)
+            continue;
+        auto begin = line.find('"');
+        auto end = (begin == std::string::npos) ? begin : line.find('"', begin + 1);
+        if (end == std::string::npos)
+            continue;
+        auto name = line.substr(begin + 1, end - begin - 1);
+        if (!included.insert(name).second)
+            continue;
+        key << "\n#file " << name << "\n";
+        for (auto &directory : directories)
+        {
+            std::ifstream file(directory + "/" + name);
+            if (!file.is_open())
+                continue;
+            std::string header((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            key << header;
+            appendIncludes(header, directories, depth + 1, included, key);
+            break;
+        }
+    }
+}
+
+std::string ProgramCache::getFileName(const std::string &key)
+{
+    // 64-bit FNV-1a hash of the key
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto c : key)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    std::ostringstream fileName;
+    fileName << m_directory << "/program_" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+    return fileName.str();
+}
+
+bool ProgramCache::load(const std::string &key, std::vector<unsigned char> &binary)
+{
+    std::ifstream file(getFileName(key), std::ios_base::binary);
+    if (!file.is_open())
+        return false;
+
+    uint64_t keySize = 0;
+    uint64_t binarySize = 0;
+    file.read(reinterpret_cast<char *>(&keySize), sizeof(keySize));
+    if (!file || keySize != key.size())
+        return false;
+    std::string storedKey(keySize, '\0');
+    file.read(&storedKey[0], keySize);
+    file.read(reinterpret_cast<char *>(&binarySize), sizeof(binarySize));
+    if (!file || storedKey != key || binarySize == 0)
+        return false;
+    binary.resize(binarySize);
+    file.read(reinterpret_cast<char *>(&binary[0]), binarySize);
+    return static_cast<bool>(file);
+}
+
+void ProgramCache::save(const std::string &key, const std::vector<unsigned char> &binary)
+{
+    // Cache is only an optimization, so failure of writing is not an error
+    if (binary.empty())
+        return;
+    std::ofstream file(getFileName(key), std::ios_base::binary | std::ios_base::trunc);
+    if (!file.is_open())
+        return;
+
+    uint64_t keySize = key.size();
+    uint64_t binarySize = binary.size();
+    file.write(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+    file.write(key.data(), keySize);
+    file.write(reinterpret_cast<const char *>(&binarySize), sizeof(binarySize));
+    file.write(reinterpret_cast<const char *>(&binary[0]), binarySize);
+}
@@ -0,0 +1,45 @@
+#ifndef PROGRAMCACHE_H
+#define PROGRAMCACHE_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+On-disk cache of program binaries.
+Binary of every device is stored in a separate file named by hash of
+the source text with its quoted includes, build options, platform and
+device name, driver version and version of the cache. The full key is also stored in the file, so a stale or
+colliding entry is detected and rebuilt from source.
+*/
+class ProgramCache
+{
+public:
+    ProgramCache();
+    /**
+    Set directory for cached binaries.
+
+    @param directory existing directory, empty string disables the cache.
+    */
+    inline void setDirectory(std::string directory) { m_directory = directory; }
+    inline bool isEnabled() { return !m_directory.empty(); }
+    cl::Program build(const cl::Context &context, const std::vector<cl::Device> &devices, const cl::Program::Sources &sources, const std::string &options);
+    inline size_t getHits() { return m_hits; }
+    inline size_t getMisses() { return m_misses; }
+private:
+    std::string getKey(const cl::Device &device, const cl::Program::Sources &sources, const std::string &options);
+    std::vector<std::string> getIncludeDirectories(const std::string &options);
+    void appendIncludes(const std::string &text, const std::vector<std::string> &directories, int depth,
+                        std::set<std::string> &included, std::ostringstream &key);
+    std::string getFileName(const std::string &key);
+    bool load(const std::string &key, std::vector<unsigned char> &binary);
+    void save(const std::string &key, const std::vector<unsigned char> &binary);
+    std::string m_directory;
+    size_t m_hits;
+    size_t m_misses;
+};
+
+#endif // PROGRAMCACHE_H
@@ -0,0 +1,90 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool()
+    : m_threadsCount(1),
+      m_task(nullptr),
+      m_tasksCount(0),
+      m_nextTask(0),
+      m_finishedTasks(0),
+      m_stop(false)
+{
+    setThreadsCount(0);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+void ThreadPool::setThreadsCount(size_t threadsCount)
+{
+    stop();
+    if (threadsCount == 0)
+        threadsCount = std::thread::hardware_concurrency();
+    m_threadsCount = std::max<size_t>(threadsCount, 1);
+}
+
+void ThreadPool::run(size_t tasksCount, const std::function<void(size_t)> &task)
+{
+    std::lock_guard<std::mutex> runLock(m_runMutex);
+    if (m_workers.empty() && m_threadsCount > 1 && tasksCount > 1)
+        start();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_task = &task;
+    m_tasksCount = tasksCount;
+    m_nextTask = 0;
+    m_finishedTasks = 0;
+    m_wakeUp.notify_all();
+    runTasks(lock);
+    m_done.wait(lock, [this] { return m_finishedTasks == m_tasksCount; });
+    // Workers go to sleep until the next run
+    m_tasksCount = 0;
+    m_nextTask = 0;
+    m_task = nullptr;
+}
+
+void ThreadPool::start()
+{
+    m_stop = false;
+    for (size_t i = 1; i < m_threadsCount; ++i)
+        m_workers.emplace_back(&ThreadPool::work, this);
+}
+
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeUp.notify_all();
+    for (auto &worker : m_workers)
+        worker.join();
+    m_workers.clear();
+}
+
+void ThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_wakeUp.wait(lock, [this] { return m_stop || m_nextTask < m_tasksCount; });
+        if (m_stop)
+            return;
+        runTasks(lock);
+    }
+}
+
+void ThreadPool::runTasks(std::unique_lock<std::mutex> &lock)
+{
+    while (m_nextTask < m_tasksCount)
+    {
+        size_t index = m_nextTask++;
+        lock.unlock();
+        (*m_task)(index);
+        lock.lock();
+        if (++m_finishedTasks == m_tasksCount)
+            m_done.notify_all();
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+Pool of host worker threads.
+Workers are started on the first run and sleep between runs, so tiles
+are processed without creating threads. The calling thread takes tasks
+together with the workers.
+*/
+class ThreadPool
+{
+public:
+    ThreadPool();
+    ~ThreadPool();
+    /**
+    Set number of threads including the calling one. Workers are
+    restarted on the next run.
+
+    @param threadsCount number of threads, 0 for number of hardware threads.
+    */
+    void setThreadsCount(size_t threadsCount);
+    inline size_t getThreadsCount() { return m_threadsCount; }
+    /**
+    Call task for every index from 0 to tasksCount - 1 on all threads and
+    wait until all calls finish. Runs from different threads are serialized.
+
+    @param tasksCount number of tasks.
+    @param task function of task index, shouldn't throw.
+    */
+    void run(size_t tasksCount, const std::function<void(size_t)> &task);
+private:
+    void start();
+    void stop();
+    void work();
+    void runTasks(std::unique_lock<std::mutex> &lock);
+    size_t m_threadsCount;
+    std::vector<std::thread> m_workers;
+    std::mutex m_runMutex;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeUp;
+    std::condition_variable m_done;
+    const std::function<void(size_t)> *m_task;
+    size_t m_tasksCount;
+    size_t m_nextTask;
+    size_t m_finishedTasks;
+    bool m_stop;
+};
+
+#endif // THREADPOOL_H
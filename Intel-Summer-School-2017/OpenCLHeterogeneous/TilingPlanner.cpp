@@ -0,0 +1,119 @@
+#include "TilingPlanner.h"
+#include <algorithm>
+
+// Part of global memory of device which can be used by tiles, the rest is left for runtime and other objects
+const cl_double TILING_MEMORY_FRACTION = 0.5;
+// Width of tile is aligned to this number of pixels (256 bytes of RGBA pixels)
+const size_t TILE_WIDTH_ALIGNMENT = 64;
+// Sizes of square tiles which are tried in measured search
+const size_t TILE_CANDIDATE_SIDES[] = { 256, 512, 1024, 2048, 4096 };
+
+TilingPlanner::TilingPlanner()
+    : m_maxImageWidth(0),
+      m_maxImageHeight(0),
+      m_maxAllocSize(0),
+      m_globalMemSize(0)
+{ }
+
+void TilingPlanner::setDevices(const std::vector<cl::Device> &devices)
+{
+    bool first = true;
+    for (auto &device : devices)
+    {
+        size_t maxImageWidth = device.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>();
+        size_t maxImageHeight = device.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>();
+        cl_ulong maxAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        cl_ulong globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+        m_maxImageWidth = first ? maxImageWidth : std::min(m_maxImageWidth, maxImageWidth);
+        m_maxImageHeight = first ? maxImageHeight : std::min(m_maxImageHeight, maxImageHeight);
+        m_maxAllocSize = first ? maxAllocSize : std::min(m_maxAllocSize, maxAllocSize);
+        m_globalMemSize = first ? globalMemSize : std::min(m_globalMemSize, globalMemSize);
+        first = false;
+    }
+}
+
+TilingPlan TilingPlanner::plan(size_t imageWidth, size_t imageHeight, size_t tilesInFlight, size_t inputBytesPerPixel, size_t outputBytesPerPixel, size_t halo)
+{
+    TilingPlan plan;
+    plan.imageWidth = imageWidth;
+    plan.imageHeight = imageHeight;
+    plan.tilesInFlight = std::max<size_t>(tilesInFlight, 1);
+    plan.inputBytesPerPixel = inputBytesPerPixel;
+    plan.outputBytesPerPixel = outputBytesPerPixel;
+    plan.bytesPerPixel = inputBytesPerPixel + outputBytesPerPixel;
+    plan.halo = halo;
+    plan.memoryBudget = static_cast<cl_ulong>(m_globalMemSize * TILING_MEMORY_FRACTION);
+    // Input image of the tile has the halo on both sides and must fit to the image limits too,
+    // the halo is cut at borders, so the whole width or height needs no more than the image
+    plan.maxTileWidth = (imageWidth <= m_maxImageWidth) ? imageWidth : std::max<size_t>(m_maxImageWidth, 2 * halo + 1) - 2 * halo;
+    plan.maxTileHeight = (imageHeight <= m_maxImageHeight) ? imageHeight : std::max<size_t>(m_maxImageHeight, 2 * halo + 1) - 2 * halo;
+
+    // One image is limited by the maximum allocation, all tiles in flight are limited by the budget
+    cl_ulong allocPixels = m_maxAllocSize / std::max(inputBytesPerPixel, outputBytesPerPixel);
+    cl_ulong budgetPixels = plan.memoryBudget / (plan.bytesPerPixel * plan.tilesInFlight);
+    plan.maxTilePixels = static_cast<size_t>(std::max<cl_ulong>(std::min(allocPixels, budgetPixels), 1));
+
+    plan.tileWidth = plan.maxTileWidth;
+    if (plan.tileWidth > plan.maxTilePixels)
+        plan.tileWidth = std::max(plan.maxTilePixels / TILE_WIDTH_ALIGNMENT * TILE_WIDTH_ALIGNMENT, TILE_WIDTH_ALIGNMENT);
+    plan.tileWidth = std::max<size_t>(std::min(plan.tileWidth, plan.maxTilePixels), 1);
+    plan.tileHeight = std::max<size_t>(std::min(plan.maxTileHeight, getMaxTileHeight(plan, plan.tileWidth)), 1);
+    plan.measured = false;
+    return plan;
+}
+
+size_t TilingPlanner::getMaxTileHeight(const TilingPlan &plan, size_t width)
+{
+    // Input of every tile in flight has (width + 2 * halo) x (height + 2 * halo) pixels, output has width x height.
+    // Tiles of the full width have no columns of halo
+    size_t haloColumns = (width < plan.imageWidth) ? 2 * plan.halo : 0;
+    cl_ulong inputRowBytes = static_cast<cl_ulong>(width + haloColumns) * plan.inputBytesPerPixel;
+    cl_ulong outputRowBytes = static_cast<cl_ulong>(width) * plan.outputBytesPerPixel;
+    cl_ulong haloBytes = 2 * plan.halo * inputRowBytes;
+    cl_ulong tileBudget = plan.memoryBudget / plan.tilesInFlight;
+    cl_ulong budgetRows = (tileBudget > haloBytes) ? (tileBudget - haloBytes) / (inputRowBytes + outputRowBytes) : 0;
+    // Every image is also limited by the maximum allocation
+    cl_ulong inputRows = m_maxAllocSize / inputRowBytes;
+    cl_ulong inputAllocRows = (inputRows > 2 * plan.halo) ? inputRows - 2 * plan.halo : 0;
+    cl_ulong outputAllocRows = m_maxAllocSize / std::max<cl_ulong>(outputRowBytes, 1);
+    return static_cast<size_t>(std::min(budgetRows, std::min(inputAllocRows, outputAllocRows)));
+}
+
+std::vector<std::pair<size_t, size_t>> TilingPlanner::getCandidates(const TilingPlan &plan)
+{
+    std::vector<std::pair<size_t, size_t>> candidates;
+    candidates.push_back({ plan.tileWidth, plan.tileHeight });
+    for (auto side : TILE_CANDIDATE_SIDES)
+    {
+        size_t width = std::min(side, plan.maxTileWidth);
+        if (width < plan.imageWidth)
+            width = std::max(width / TILE_WIDTH_ALIGNMENT * TILE_WIDTH_ALIGNMENT, std::min(TILE_WIDTH_ALIGNMENT, plan.maxTileWidth));
+        size_t maxHeight = getMaxTileHeight(plan, width);
+        if (width > plan.maxTilePixels || maxHeight == 0)
+            continue;
+        size_t height = std::min(std::min(side, plan.maxTileHeight), maxHeight);
+        std::pair<size_t, size_t> candidate(width, std::max<size_t>(height, 1));
+        if (std::find(candidates.begin(), candidates.end(), candidate) == candidates.end())
+            candidates.push_back(candidate);
+    }
+    return candidates;
+}
+
+void TilingPlanner::print(const TilingPlan &plan, std::ostream &out)
+{
+    size_t xTiles = (plan.imageWidth + plan.tileWidth - 1) / plan.tileWidth;
+    size_t yTiles = (plan.imageHeight + plan.tileHeight - 1) / plan.tileHeight;
+    size_t haloColumns = (plan.tileWidth < plan.imageWidth) ? 2 * plan.halo : 0;
+    size_t tileBytes = (plan.tileWidth + haloColumns) * (plan.tileHeight + 2 * plan.halo) * plan.inputBytesPerPixel
+                     + plan.tileWidth * plan.tileHeight * plan.outputBytesPerPixel;
+    out << "Tiling plan for image " << plan.imageWidth << "x" << plan.imageHeight << ":" << std::endl;
+    out << "    max tile: " << plan.maxTileWidth << "x" << plan.maxTileHeight << ", " << plan.maxTilePixels << " pixels" << std::endl;
+    out << "    memory budget: " << plan.memoryBudget / (1024 * 1024) << " MB for " << plan.tilesInFlight
+        << " tiles in flight (" << plan.bytesPerPixel << " bytes per pixel";
+    if (plan.halo != 0)
+        out << ", halo " << plan.halo;
+    out << ")" << std::endl;
+    out << "    tile: " << plan.tileWidth << "x" << plan.tileHeight << (plan.measured ? " (measured)" : "")
+        << ", " << xTiles << "x" << yTiles << " tiles, "
+        << tileBytes * plan.tilesInFlight / (1024 * 1024) << " MB in flight" << std::endl;
+}
@@ -0,0 +1,71 @@
+#ifndef TILINGPLANNER_H
+#define TILINGPLANNER_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+struct TilingPlan
+{
+    size_t imageWidth;
+    size_t imageHeight;
+    // Limits of one tile, the smallest over all devices
+    size_t maxTileWidth;
+    size_t maxTileHeight;
+    size_t maxTilePixels;
+    // Part of global memory which can be used by tiles in flight
+    cl_ulong memoryBudget;
+    size_t tilesInFlight;
+    size_t inputBytesPerPixel;
+    size_t outputBytesPerPixel;
+    size_t bytesPerPixel;
+    // Rows and columns read around the tile on every side, input tile is larger by 2 * halo
+    size_t halo;
+    // Chosen tile
+    size_t tileWidth;
+    size_t tileHeight;
+    bool measured;
+};
+
+/**
+Planner of tile sizes.
+It takes into account image size limits of devices, maximum size of one
+allocation and global memory size divided between all images which are
+alive at the same time (input and output of every tile in flight).
+*/
+class TilingPlanner
+{
+public:
+    TilingPlanner();
+    void setDevices(const std::vector<cl::Device> &devices);
+    /**
+    Calculate limits of tile and choose the default tile: strip of the full
+    (or the maximum allowed) width, so rows of the tile are contiguous in
+    host memory and reads of neighbour work-items are coalesced.
+
+    @param imageWidth width of the whole image.
+    @param imageHeight height of the whole image.
+    @param tilesInFlight number of tiles which are processed at the same time.
+    @param inputBytesPerPixel size of pixel in input image.
+    @param outputBytesPerPixel size of pixel in output image.
+    @param halo radius of convolution, input of every tile is extended by it on all sides.
+    */
+    TilingPlan plan(size_t imageWidth, size_t imageHeight, size_t tilesInFlight, size_t inputBytesPerPixel, size_t outputBytesPerPixel, size_t halo = 0);
+    /**
+    Get tile shapes for measured search. All of them fit to the plan limits,
+    widths are multiples of 64 pixels if they are less than image width.
+    */
+    std::vector<std::pair<size_t, size_t>> getCandidates(const TilingPlan &plan);
+    static void print(const TilingPlan &plan, std::ostream &out = std::cout);
+private:
+    // The largest height of tile of the given width which fits to allocation and budget limits with its halo
+    size_t getMaxTileHeight(const TilingPlan &plan, size_t width);
+    size_t m_maxImageWidth;
+    size_t m_maxImageHeight;
+    cl_ulong m_maxAllocSize;
+    cl_ulong m_globalMemSize;
+};
+
+#endif // TILINGPLANNER_H
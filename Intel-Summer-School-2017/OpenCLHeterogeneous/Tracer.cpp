@@ -0,0 +1,153 @@
+#include "Tracer.h"
+#include "errorcodes.h"
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+// Process ids of host and device rows in the trace
+const int HOST_PID = 1;
+const int DEVICE_PID = 2;
+// Limit of recorded commands and host spans, every command keeps its event alive until export
+const size_t MAX_TRACE_RECORDS = 100000;
+
+static std::string EscapeJson(const std::string &str)
+{
+    std::string escaped;
+    for (auto c : str)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            escaped += c;
+    }
+    return escaped;
+}
+
+Tracer::Span::Span(Tracer &tracer, const std::string &name)
+    : m_tracer(tracer),
+      m_name(name),
+      m_start(tracer.isEnabled() ? tracer.getHostTime() : 0)
+{ }
+
+Tracer::Span::~Span()
+{
+    if (m_tracer.isEnabled())
+        m_tracer.addHostSpan(m_name, m_start, m_tracer.getHostTime());
+}
+
+Tracer::Tracer()
+    : m_enabled(false),
+      m_epoch(std::chrono::steady_clock::now()),
+      m_droppedRecords(0)
+{ }
+
+cl_ulong Tracer::getHostTime()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+}
+
+void Tracer::addCommand(cl_command_queue queue, const std::string &deviceName, const std::string &name,
+                        size_t xOffset, size_t yOffset, size_t width, size_t height, size_t bytes, const cl::Event &event)
+{
+    auto hostTime = getHostTime();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_commands.size() >= MAX_TRACE_RECORDS)
+    {
+        ++m_droppedRecords;
+        return;
+    }
+    auto track = m_tracks.find(queue);
+    if (track == m_tracks.end())
+    {
+        std::ostringstream trackName;
+        trackName << deviceName << " (queue " << m_trackNames.size() << ")";
+        track = m_tracks.insert(std::make_pair(queue, m_trackNames.size())).first;
+        m_trackNames.push_back(trackName.str());
+    }
+    m_commands.push_back({ track->second, name, xOffset, yOffset, width, height, bytes, hostTime, event });
+}
+
+void Tracer::addHostSpan(const std::string &name, cl_ulong start, cl_ulong end)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_hostSpans.size() >= MAX_TRACE_RECORDS)
+    {
+        ++m_droppedRecords;
+        return;
+    }
+    size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id()) % 1000000;
+    m_hostSpans.push_back({ name, thread, start, end });
+}
+
+void Tracer::exportChromeTrace(const std::string &fileName)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::ofstream trace(fileName);
+    if (!trace.is_open())
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Cannot open " + fileName + " with writing access!").c_str());
+
+    // Device timestamps are moved to host time by the difference between host time of enqueue
+    // and QUEUED timestamp of the first command of every track
+    std::vector<bool> hasOffset(m_trackNames.size(), false);
+    std::vector<cl_long> offsets(m_trackNames.size(), 0);
+
+    // Timestamps are in microseconds with nanosecond resolution
+    trace << std::fixed << std::setprecision(3);
+    trace << "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_records\": " << m_droppedRecords << "}, \"traceEvents\": [" << std::endl;
+    trace << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << HOST_PID << ", \"args\": {\"name\": \"Host\"}}";
+    trace << ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << DEVICE_PID << ", \"args\": {\"name\": \"OpenCL queues\"}}";
+    for (size_t i = 0; i < m_trackNames.size(); ++i)
+    {
+        trace << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << DEVICE_PID << ", \"tid\": " << 2 * i
+              << ", \"args\": {\"name\": \"" << EscapeJson(m_trackNames[i]) << "\"}}";
+        trace << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << DEVICE_PID << ", \"tid\": " << 2 * i + 1
+              << ", \"args\": {\"name\": \"" << EscapeJson(m_trackNames[i]) << " waiting\"}}";
+    }
+
+    for (auto &span : m_hostSpans)
+    {
+        trace << ",\n{\"name\": \"" << EscapeJson(span.name) << "\", \"cat\": \"host\", \"ph\": \"X\", \"pid\": " << HOST_PID
+              << ", \"tid\": " << span.thread << ", \"ts\": " << span.start / 1000.0 << ", \"dur\": " << (span.end - span.start) / 1000.0 << "}";
+    }
+
+    for (auto &command : m_commands)
+    {
+        auto queued = command.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+        auto submit = command.event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+        auto start = command.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        auto end = command.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        if (!hasOffset[command.track])
+        {
+            offsets[command.track] = static_cast<cl_long>(command.hostTime) - static_cast<cl_long>(queued);
+            hasOffset[command.track] = true;
+        }
+        auto offset = offsets[command.track];
+        std::ostringstream args;
+        args << "{\"tile\": \"" << command.xOffset << "," << command.yOffset << " " << command.width << "x" << command.height << "\""
+             << ", \"bytes\": " << command.bytes
+             << ", \"queued_to_submit_us\": " << (submit - queued) / 1000.0
+             << ", \"submit_to_start_us\": " << (start - submit) / 1000.0 << "}";
+        trace << ",\n{\"name\": \"" << EscapeJson(command.name) << "\", \"cat\": \"command\", \"ph\": \"X\", \"pid\": " << DEVICE_PID
+              << ", \"tid\": " << 2 * command.track << ", \"ts\": " << (static_cast<cl_long>(start) + offset) / 1000.0
+              << ", \"dur\": " << (end - start) / 1000.0 << ", \"args\": " << args.str() << "}";
+        trace << ",\n{\"name\": \"" << EscapeJson(command.name) << " waiting\", \"cat\": \"latency\", \"ph\": \"X\", \"pid\": " << DEVICE_PID
+              << ", \"tid\": " << 2 * command.track + 1 << ", \"ts\": " << (static_cast<cl_long>(queued) + offset) / 1000.0
+              << ", \"dur\": " << (start - queued) / 1000.0 << ", \"args\": " << args.str() << "}";
+    }
+    trace << "\n]}" << std::endl;
+    if (m_droppedRecords != 0)
+        std::cout << "Trace is limited to " << MAX_TRACE_RECORDS << " commands and host spans, " << m_droppedRecords << " were dropped." << std::endl;
+}
+
+void Tracer::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tracks.clear();
+    m_trackNames.clear();
+    m_commands.clear();
+    m_hostSpans.clear();
+    m_droppedRecords = 0;
+}
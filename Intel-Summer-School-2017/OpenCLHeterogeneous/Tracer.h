@@ -0,0 +1,78 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include <CL/cl.hpp>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+Recorder of enqueued commands and host spans.
+Commands keep their events, profiling timestamps (QUEUED, SUBMIT,
+START, END) are read only on export, so recording doesn't wait for
+device. Result is exported in Chrome trace-event format, which can be
+opened in chrome://tracing or Perfetto UI. Number of recorded commands
+and spans is limited, records over the limit are only counted, and
+clear() starts a new trace, e.g. after export of every image.
+*/
+class Tracer
+{
+public:
+    /**
+    Host span which is recorded on destruction.
+    */
+    class Span
+    {
+    public:
+        Span(Tracer &tracer, const std::string &name);
+        ~Span();
+    private:
+        Tracer &m_tracer;
+        std::string m_name;
+        cl_ulong m_start;
+    };
+
+    Tracer();
+    inline void setEnabled(bool enabled) { m_enabled = enabled; }
+    inline bool isEnabled() { return m_enabled; }
+    void addCommand(cl_command_queue queue, const std::string &deviceName, const std::string &name,
+                    size_t xOffset, size_t yOffset, size_t width, size_t height, size_t bytes, const cl::Event &event);
+    void addHostSpan(const std::string &name, cl_ulong start, cl_ulong end);
+    void exportChromeTrace(const std::string &fileName);
+    void clear();
+    // Host time in nanoseconds from creation of tracer
+    cl_ulong getHostTime();
+private:
+    struct Command
+    {
+        size_t track;
+        std::string name;
+        size_t xOffset;
+        size_t yOffset;
+        size_t width;
+        size_t height;
+        size_t bytes;
+        cl_ulong hostTime;
+        cl::Event event;
+    };
+    struct HostSpan
+    {
+        std::string name;
+        size_t thread;
+        cl_ulong start;
+        cl_ulong end;
+    };
+    bool m_enabled;
+    std::chrono::steady_clock::time_point m_epoch;
+    std::map<cl_command_queue, size_t> m_tracks;
+    std::vector<std::string> m_trackNames;
+    std::vector<Command> m_commands;
+    std::vector<HostSpan> m_hostSpans;
+    size_t m_droppedRecords;
+    std::mutex m_mutex;
+};
+
+#endif // TRACER_H
@@ -0,0 +1,201 @@
+#include "batchprocessing.h"
+#include "imagefunctions.h"
+#include "BMPStream.h"
+#include "errorcodes.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <utility>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Default host memory for input and results of one strip in streaming mode
+const size_t STREAM_STRIP_SIZE = 64 * 1024 * 1024;
+
+static bool EndsWith(const std::string &str, const std::string &suffix)
+{
+    if (str.size() < suffix.size())
+        return false;
+    auto tail = str.substr(str.size() - suffix.size());
+    std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+    return tail == suffix;
+}
+
+static std::string GetBaseName(const std::string &path)
+{
+    auto pos = path.find_last_of("/\\");
+    return (pos == std::string::npos) ? path : path.substr(pos + 1);
+}
+
+static std::vector<std::string> GetOutputNames(const std::vector<std::string> &files)
+{
+    // Inputs with the same name from different directories get the index in the batch, so they don't overwrite each other
+    std::map<std::string, size_t> counts;
+    for (auto &file : files)
+        ++counts[GetBaseName(file)];
+    std::vector<std::string> names;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        auto baseName = GetBaseName(files[i]);
+        names.push_back(counts[baseName] == 1 ? "out_" + baseName : "out_" + std::to_string(i) + "_" + baseName);
+    }
+    return names;
+}
+
+static double GetPercentile(const std::vector<double> &sorted, double percent)
+{
+    auto index = static_cast<size_t>(percent / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+std::vector<std::string> CollectImageFiles(const std::string &path)
+{
+    std::vector<std::string> files;
+    struct stat pathStat;
+    if (stat(path.c_str(), &pathStat) != 0)
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not open " + path + "!").c_str());
+
+    if (S_ISDIR(pathStat.st_mode))
+    {
+        DIR *dir = opendir(path.c_str());
+        if (dir == nullptr)
+            throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not open directory " + path + "!").c_str());
+        while (auto entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if (EndsWith(name, ".bmp"))
+                files.push_back(path + "/" + name);
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+    }
+    else if (EndsWith(path, ".txt") || EndsWith(path, ".lst"))
+    {
+        std::ifstream list(path);
+        if (!list.is_open())
+            throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not open " + path + "!").c_str());
+        std::string line;
+        while (std::getline(list, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty())
+                files.push_back(line);
+        }
+    }
+    else
+    {
+        files.push_back(path);
+    }
+    return files;
+}
+
+void ProcessBatch(OpenCLWrapper &ocl, const std::vector<std::string> &files, const std::string &outputDir, bool mappedOutput)
+{
+    std::vector<double> latencies;
+    // Buffers of the loaded and the previous input image are swapped with the wrapper, so no image is allocated in steady state
+    std::vector<unsigned char> img;
+    auto outputNames = GetOutputNames(files);
+    auto batchTimeStart = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        auto &file = files[i];
+        auto imageTimeStart = std::chrono::high_resolution_clock::now();
+        cl_int2 img_size;
+        {
+            Tracer::Span span(ocl.getTracer(), "load");
+            LoadImageAsBMP(file, img_size, img);
+        }
+
+        auto outputFile = outputDir + "/" + outputNames[i];
+        MappedOutputBMP outputBmp;
+        bool directOutput = false;
+        if (mappedOutput)
+        {
+            outputBmp = CreateMappedBMP(outputFile, img_size.s[0], img_size.s[1], 8 * ocl.getResultBytesPerPixel());
+            // Rows of gray BMP are padded if width isn't multiple of 4, such results are saved as usual
+            directOutput = (outputBmp.rowPitch == (size_t)img_size.s[0] * ocl.getResultBytesPerPixel());
+        }
+        ocl.setResultsTarget(directOutput ? outputBmp.pixels : nullptr);
+
+        ocl.createInputAndOutputImages(std::move(img), img_size);
+        ocl.runKernel();
+
+        {
+            Tracer::Span span(ocl.getTracer(), "save");
+            // Results read to the mapped file are written back when it's unmapped, wrapper stops using it before
+            ocl.setResultsTarget(nullptr);
+            outputBmp = MappedOutputBMP();
+            if (!directOutput)
+            {
+                auto results = ocl.getResults();
+                unsigned int *p = reinterpret_cast<unsigned int *>(&results[0]);
+                if (ocl.getResultBytesPerPixel() == 1)
+                    SaveGrayImageAsBMP(&results[0], img_size.s[0], img_size.s[1], outputFile);
+                else
+                    SaveImageAsBMP(p, img_size.s[0], img_size.s[1], outputFile);
+            }
+        }
+        auto imageTimeEnd = std::chrono::high_resolution_clock::now();
+        latencies.push_back(std::chrono::duration<double, std::milli>(imageTimeEnd - imageTimeStart).count());
+    }
+    auto batchTimeEnd = std::chrono::high_resolution_clock::now();
+    if (latencies.empty())
+    {
+        std::cout << "No images to process." << std::endl;
+        return;
+    }
+
+    double totalTime = std::chrono::duration<double, std::milli>(batchTimeEnd - batchTimeStart).count();
+    std::sort(latencies.begin(), latencies.end());
+    ocl.printTimes();
+    std::cout << "Processed images: " << latencies.size() << " in " << totalTime << " ms. ("
+              << latencies.size() * 1000.0 / totalTime << " images/s)" << std::endl;
+    std::cout << "Latency per image: min " << latencies.front()
+              << " ms., p50 " << GetPercentile(latencies, 50)
+              << " ms., p90 " << GetPercentile(latencies, 90)
+              << " ms., p99 " << GetPercentile(latencies, 99)
+              << " ms., max " << latencies.back() << " ms." << std::endl;
+}
+
+void ProcessImageInStrips(OpenCLWrapper &ocl, const std::string &inputFile, const std::string &outputFile, size_t maxStripBytes)
+{
+    auto startTime = std::chrono::high_resolution_clock::now();
+    BMPStripReader reader(inputFile);
+    cl_int2 size = reader.getSize();
+    size_t height = size.s[1];
+    size_t stripHeight = ocl.getStripHeight(size, (maxStripBytes != 0) ? maxStripBytes : STREAM_STRIP_SIZE);
+    BMPStripWriter writer(outputFile, size.s[0], size.s[1], ocl.getResultBytesPerPixel());
+    // Buffers of the read and the previous strip are swapped with the wrapper like images of batch
+    std::vector<unsigned char> strip;
+    double firstOutputTime = 0;
+    ocl.setResultsTarget(nullptr);
+    for (size_t row = 0; row < height; row += stripHeight)
+    {
+        size_t rows = std::min(stripHeight, height - row);
+        {
+            Tracer::Span span(ocl.getTracer(), "load");
+            reader.readStrip(rows, strip);
+        }
+
+        cl_int2 stripSize = { { size.s[0], (cl_int)rows } };
+        ocl.createInputAndOutputImages(std::move(strip), stripSize);
+        ocl.runKernel();
+
+        {
+            Tracer::Span span(ocl.getTracer(), "save");
+            writer.writeStrip(ocl.getResultsData(), rows);
+        }
+        if (row == 0)
+            firstOutputTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+    }
+    writer.close();
+    auto endTime = std::chrono::high_resolution_clock::now();
+
+    ocl.printTimes();
+    std::cout << "Processed strips: " << (height + stripHeight - 1) / stripHeight << " of " << stripHeight << " rows." << std::endl;
+    std::cout << "Time to first output: " << firstOutputTime << " ms., total time: "
+              << std::chrono::duration<double, std::milli>(endTime - startTime).count() << " ms." << std::endl;
+}
@@ -0,0 +1,46 @@
+#ifndef BATCHPROCESSING_H
+#define BATCHPROCESSING_H
+
+#include <string>
+#include <vector>
+#include "OpenCLWrapper.h"
+
+/**
+Collect BMP files for batch processing.
+Path can be a directory (all *.bmp files in it are taken in sorted
+order), a text file with .txt or .lst extension which contains one path
+per line, or a single BMP file.
+
+@param path directory, list file or BMP file.
+@return paths of BMP files.
+*/
+std::vector<std::string> CollectImageFiles(const std::string &path);
+/**
+Process images one by one with already initialized wrapper.
+Platform, context, queues, program and kernel are created only once
+before the call. Aggregate throughput and latency percentiles are
+printed at the end.
+
+@param ocl wrapper with created context, program and kernel.
+@param files paths of input BMP files.
+@param outputDir directory for output images, they are named as out_<input name>,
+or out_<index in files>_<input name> if several inputs have the same name.
+@param mappedOutput true to read results right to output files mapped to memory.
+*/
+void ProcessBatch(OpenCLWrapper &ocl, const std::vector<std::string> &files, const std::string &outputDir, bool mappedOutput = false);
+/**
+Process one image strip by strip with already initialized wrapper.
+Strips of rows are read from the input file, processed and written to
+the output file one after another, so host memory is bounded by a few
+strips and images larger than host memory can be processed. Strips are
+whole rows of tiles (see OpenCLWrapper::getStripHeight). Time to the
+first written strip and the total time are printed.
+
+@param ocl wrapper with created context, program and per-pixel kernel.
+@param inputFile input 32-bit BMP file.
+@param outputFile output BMP file, 24-bit or 8-bit gray for gray results.
+@param maxStripBytes host memory for input and results of one strip, 0 for default.
+*/
+void ProcessImageInStrips(OpenCLWrapper &ocl, const std::string &inputFile, const std::string &outputFile, size_t maxStripBytes = 0);
+
+#endif // BATCHPROCESSING_H
@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "colorenum.h"
+#include "errorcodes.h"
+#include "OpenCLWrapper.h"
+
+/*
+Benchmark of the image pipeline on synthetic RGBA images.
+
+Usage:
+    OpenCLHeterogeneousBenchmark [options]
+Options:
+    --platform intel|amd|any    - OpenCL platform (any by default, e.g. POCL)
+    --sizes WxH,WxH,...         - image sizes (64x64 ... 16384x16384 by default)
+    --gigapixel                 - add 32768x32768 image to the sweep
+    --warmup N                  - number of warm-up runs (2 by default)
+    --repeat N                  - number of measured runs (10 by default)
+    --format csv|json           - output format (csv by default)
+    --output file               - output file (stdout by default)
+    --verify                    - compare host engine with scalar reference on random images
+                                  for every instruction set and exit
+*/
+
+struct BenchmarkConfig
+{
+    std::string name;
+    OpenCLDeviceType deviceType;
+    std::function<void(OpenCLWrapper &)> setup;
+};
+
+struct BenchmarkResult
+{
+    std::string config;
+    std::string device;
+    size_t width;
+    size_t height;
+    size_t runs;
+    double minTime;
+    double medianTime;
+    double p99Time;
+    double mpixelsPerSecond;
+};
+
+static std::vector<unsigned char> GenerateImage(size_t width, size_t height)
+{
+    // Deterministic pattern, so all configurations process the same data
+    std::vector<unsigned char> img(width * height * 4);
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            auto p = &img[(y * width + x) * 4];
+            p[0] = static_cast<unsigned char>(x);
+            p[1] = static_cast<unsigned char>(y);
+            p[2] = static_cast<unsigned char>(x ^ y);
+            p[3] = 255;
+        }
+    }
+    return img;
+}
+
+static std::vector<std::pair<size_t, size_t>> ParseSizes(const std::string &str)
+{
+    std::vector<std::pair<size_t, size_t>> sizes;
+    std::istringstream stream(str);
+    std::string item;
+    while (std::getline(stream, item, ','))
+    {
+        size_t width = 0;
+        size_t height = 0;
+        char separator = 0;
+        std::istringstream itemStream(item);
+        itemStream >> width >> separator >> height;
+        if (!itemStream.fail() && separator == 'x' && width > 0 && height > 0)
+            sizes.push_back({ width, height });
+        else
+            std::cerr << "Skipping wrong size: " << item << std::endl;
+    }
+    return sizes;
+}
+
+static double GetPercentile(const std::vector<double> &sorted, double percent)
+{
+    auto index = static_cast<size_t>(percent / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static bool ParseCount(const std::string &str, int minimum, int &count)
+{
+    // Wrong numbers are reported, the default count is kept
+    char *end = nullptr;
+    long value = std::strtol(str.c_str(), &end, 10);
+    if (str.empty() || *end != '\0' || value < minimum || value > std::numeric_limits<int>::max())
+    {
+        std::cerr << "Skipping wrong count: " << str << std::endl;
+        return false;
+    }
+    count = static_cast<int>(value);
+    return true;
+}
+
+static void RunConfig(const BenchmarkConfig &config, OpenCLPlatformType platformType,
+                      const std::vector<std::pair<size_t, size_t>> &sizes, int warmup, int repeat,
+                      std::vector<BenchmarkResult> &results)
+{
+    OpenCLWrapper ocl;
+    std::string deviceName;
+    try
+    {
+        // Device configurations must not be measured on the host engine under their names
+        ocl.setHostFallback(platformType == OpenCLPlatformType::Host);
+        ocl.setPlatformAndDevice(platformType, config.deviceType);
+        config.setup(ocl);
+        ocl.createContextAndQueue();
+        ocl.getProgramSourcesFromFile("OpenCLImages.cl");
+        ocl.buildProgram();
+        ocl.createKernel("maskToImage");
+        deviceName = ocl.getDeviceName();
+        std::replace(deviceName.begin(), deviceName.end(), '\n', ';');
+        if (!deviceName.empty() && deviceName.back() == ';')
+            deviceName.pop_back();
+    }
+    catch (cl::Error &err)
+    {
+        // Configuration is not supported by the platform (e.g. no GPU in POCL)
+        std::cerr << "Skipping " << config.name << ": " << err.what() << "(" << err.err() << ")" << std::endl;
+        return;
+    }
+
+    for (auto &size : sizes)
+    {
+        BenchmarkResult result = { config.name, deviceName, size.first, size.second, 0, 0, 0, 0, 0 };
+        try
+        {
+            cl_int2 imgSize;
+            imgSize.s[0] = static_cast<cl_int>(size.first);
+            imgSize.s[1] = static_cast<cl_int>(size.second);
+            std::vector<double> times;
+            ocl.createInputAndOutputImages(GenerateImage(size.first, size.second), imgSize);
+            for (int i = 0; i < warmup + repeat; ++i)
+            {
+                auto startTime = std::chrono::high_resolution_clock::now();
+                ocl.runKernel();
+                auto endTime = std::chrono::high_resolution_clock::now();
+                if (i >= warmup)
+                    times.push_back(std::chrono::duration<double, std::milli>(endTime - startTime).count());
+            }
+            std::sort(times.begin(), times.end());
+            result.runs = times.size();
+            result.minTime = times.front();
+            result.medianTime = GetPercentile(times, 50);
+            result.p99Time = GetPercentile(times, 99);
+            result.mpixelsPerSecond = size.first * size.second / (result.medianTime * 1000.0);
+            results.push_back(result);
+            std::cerr << config.name << " " << size.first << "x" << size.second << ": median " << result.medianTime << " ms." << std::endl;
+        }
+        catch (cl::Error &err)
+        {
+            std::cerr << "Skipping " << config.name << " " << size.first << "x" << size.second << ": " << err.what() << "(" << err.err() << ")" << std::endl;
+        }
+        catch (std::bad_alloc &)
+        {
+            std::cerr << "Skipping " << config.name << " " << size.first << "x" << size.second << ": not enough host memory" << std::endl;
+        }
+    }
+}
+
+static bool CheckEqual(const std::vector<unsigned char> &result, const std::vector<unsigned char> &reference, const std::string &name,
+                       const std::string &description, size_t width, size_t height)
+{
+    if (result == reference)
+        return true;
+    std::cerr << "FAILED " << name << " " << width << "x" << height << " on " << description << std::endl;
+    return false;
+}
+
+static bool VerifyHostEngine()
+{
+    // Edge sizes cover SIMD tails and sizes split between threads, the rest are random
+    std::vector<std::pair<size_t, size_t>> sizes = { { 1, 1 }, { 3, 2 }, { 4, 1 }, { 7, 3 }, { 8, 8 }, { 15, 2 }, { 16, 1 },
+                                                     { 17, 5 }, { 31, 3 }, { 33, 4 }, { 1023, 129 }, { 1024, 130 } };
+    std::mt19937 random(2017);
+    std::uniform_int_distribution<size_t> widths(1, 300);
+    std::uniform_int_distribution<size_t> heights(1, 40);
+    for (int i = 0; i < 50; ++i)
+        sizes.push_back({ widths(random), heights(random) });
+    std::uniform_int_distribution<int> bytes(0, 255);
+
+    const char *names[] = { "scalar", "SSE4.1", "AVX2" };
+    bool passed = true;
+    HostImageEngine engine;
+    for (auto instructionSet : { HostInstructionSet::Scalar, HostInstructionSet::SSE41, HostInstructionSet::AVX2 })
+    {
+        engine.setInstructionSet(instructionSet);
+        if (engine.getInstructionSet() != instructionSet)
+        {
+            std::cerr << "Skipping " << names[static_cast<int>(instructionSet)] << ": not supported by the processor" << std::endl;
+            continue;
+        }
+        // Several threads are set explicitly, so bands of tasks are checked on any machine
+        for (size_t threadsCount : { 1, 4 })
+        {
+            engine.setThreadsCount(threadsCount);
+            auto description = engine.getDescription();
+            bool enginePassed = true;
+            for (auto &size : sizes)
+            {
+                size_t width = size.first;
+                size_t height = size.second;
+                // Padding of rows must stay untouched
+                size_t rowPitch = width * 4 + (width % 2) * 16;
+                std::vector<unsigned char> src(rowPitch * height);
+                for (auto &byte : src)
+                    byte = static_cast<unsigned char>(bytes(random));
+
+                for (int color : { BW, RED, BLUE })
+                {
+                    std::vector<unsigned char> result(src.size(), 0xCD);
+                    std::vector<unsigned char> reference(src.size(), 0xCD);
+                    engine.maskToImage(&src[0], &result[0], width, height, rowPitch, color);
+                    HostImageEngine::maskToImageReference(&src[0], &reference[0], width, height, rowPitch, color);
+                    enginePassed = CheckEqual(result, reference, "maskToImage", description, width, height) && enginePassed;
+                }
+
+                size_t pixelsCount = width * height;
+                std::vector<unsigned char> result(src.begin(), src.begin() + pixelsCount * 4);
+                std::vector<unsigned char> reference(pixelsCount * 4);
+                HostImageEngine::convertABGRToRGBAReference(&result[0], &reference[0], pixelsCount);
+                // Conversion is also done in place by the BMP loader
+                engine.convertABGRToRGBA(&result[0], &result[0], pixelsCount);
+                enginePassed = CheckEqual(result, reference, "convertABGRToRGBA", description, width, height) && enginePassed;
+
+                size_t dstRowPitch = (width * 3 + 3) & ~static_cast<size_t>(3);
+                std::vector<unsigned char> packed(dstRowPitch * height, 0xCD);
+                std::vector<unsigned char> packedReference(dstRowPitch * height, 0xCD);
+                engine.packRowsTo24Bit(&src[0], &packed[0], width, height, dstRowPitch);
+                HostImageEngine::packRowsTo24BitReference(&src[0], &packedReference[0], width, height, dstRowPitch);
+                enginePassed = CheckEqual(packed, packedReference, "packRowsTo24Bit", description, width, height) && enginePassed;
+            }
+            std::cerr << description << ": " << (enginePassed ? "passed" : "FAILED") << std::endl;
+            passed = passed && enginePassed;
+        }
+    }
+    return passed;
+}
+
+static std::string EscapeJson(const std::string &str)
+{
+    // Control characters are dropped, quotes and backslashes are escaped
+    std::string escaped;
+    for (auto c : str)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            escaped += c;
+    }
+    return escaped;
+}
+
+static std::string EscapeCsv(const std::string &str)
+{
+    // Quotes inside of a quoted field are doubled
+    std::string escaped;
+    for (auto c : str)
+    {
+        if (c == '"')
+            escaped += '"';
+        escaped += c;
+    }
+    return escaped;
+}
+
+static void WriteResults(const std::vector<BenchmarkResult> &results, const std::string &format, std::ostream &out)
+{
+    if (format == "json")
+    {
+        out << "[" << std::endl;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            auto &r = results[i];
+            out << "  {\"config\": \"" << EscapeJson(r.config) << "\", \"device\": \"" << EscapeJson(r.device) << "\", \"width\": " << r.width
+                << ", \"height\": " << r.height << ", \"runs\": " << r.runs << ", \"min_ms\": " << r.minTime
+                << ", \"median_ms\": " << r.medianTime << ", \"p99_ms\": " << r.p99Time
+                << ", \"mpixels_per_s\": " << r.mpixelsPerSecond << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+        }
+        out << "]" << std::endl;
+        return;
+    }
+    out << "config,device,width,height,runs,min_ms,median_ms,p99_ms,mpixels_per_s" << std::endl;
+    for (auto &r : results)
+    {
+        out << r.config << ",\"" << EscapeCsv(r.device) << "\"," << r.width << "," << r.height << "," << r.runs << ","
+            << r.minTime << "," << r.medianTime << "," << r.p99Time << "," << r.mpixelsPerSecond << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    OpenCLPlatformType platformType = OpenCLPlatformType::Any;
+    auto sizes = ParseSizes("64x64,256x256,1024x1024,4096x4096,16384x16384");
+    int warmup = 2;
+    int repeat = 10;
+    std::string format = "csv";
+    std::string outputFile;
+    bool verify = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--platform" && hasValue)
+        {
+            std::string platform = argv[++i];
+            platformType = (platform == "intel") ? OpenCLPlatformType::Intel : (platform == "amd") ? OpenCLPlatformType::AMD : OpenCLPlatformType::Any;
+        }
+        else if (arg == "--sizes" && hasValue)
+            sizes = ParseSizes(argv[++i]);
+        else if (arg == "--gigapixel")
+            sizes.push_back({ 32768, 32768 });
+        else if (arg == "--warmup" && hasValue)
+            ParseCount(argv[++i], 0, warmup);
+        else if (arg == "--repeat" && hasValue)
+            ParseCount(argv[++i], 1, repeat);
+        else if (arg == "--format" && hasValue)
+            format = argv[++i];
+        else if (arg == "--output" && hasValue)
+            outputFile = argv[++i];
+        else if (arg == "--verify")
+            verify = true;
+        else
+            std::cerr << "Unknown option: " << arg << std::endl;
+    }
+
+    if (verify)
+        return VerifyHostEngine() ? 0 : HOST_VERIFICATION_FAILED;
+
+    std::vector<BenchmarkConfig> configs = {
+        { "cpu", OpenCLDeviceType::CPU, [](OpenCLWrapper &) {} },
+        { "gpu", OpenCLDeviceType::GPU, [](OpenCLWrapper &) {} },
+        { "cpu_buffer", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.setBackend(OpenCLDeviceType::CPU, OpenCLBackend::Buffer); } },
+        { "gpu_buffer", OpenCLDeviceType::GPU, [](OpenCLWrapper &ocl) { ocl.setBackend(OpenCLDeviceType::GPU, OpenCLBackend::Buffer); } },
+        { "cpu_gray", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.setGrayOutput(true); } },
+        { "gpu_gray", OpenCLDeviceType::GPU, [](OpenCLWrapper &ocl) { ocl.setGrayOutput(true); } },
+        { "cpu_buffer_gray", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.setBackend(OpenCLDeviceType::CPU, OpenCLBackend::Buffer); ocl.setGrayOutput(true); } },
+        { "cpu_pipelined", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.setPipelined(true); } },
+        { "gpu_pipelined", OpenCLDeviceType::GPU, [](OpenCLWrapper &ocl) { ocl.setPipelined(true); } },
+        { "cpu_tile_512", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.setTileSize(512, 512); } },
+        { "cpu_tile_2048", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.setTileSize(2048, 2048); } },
+        { "gpu_tile_512", OpenCLDeviceType::GPU, [](OpenCLWrapper &ocl) { ocl.setTileSize(512, 512); } },
+        { "gpu_tile_2048", OpenCLDeviceType::GPU, [](OpenCLWrapper &ocl) { ocl.setTileSize(2048, 2048); } },
+        { "cpu_local_size", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.setLocalSizeTuningFile("local_size.txt"); } },
+        { "gpu_local_size", OpenCLDeviceType::GPU, [](OpenCLWrapper &ocl) { ocl.setLocalSizeTuningFile("local_size.txt"); } },
+        { "combo_0.25", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setRatio(0.25); } },
+        { "combo_0.50", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setRatio(0.5); } },
+        { "combo_0.75", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setRatio(0.75); } },
+        { "combo_adaptive", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setAdaptiveRatio(true); } },
+        { "combo_cpu_buffer", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setBackend(OpenCLDeviceType::CPU, OpenCLBackend::Buffer); } },
+        { "combo_dynamic", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setDynamicScheduling(true); } },
+        { "combo_host", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setHostParticipant(true); } },
+        { "combo_host_adaptive", OpenCLDeviceType::COMBO, [](OpenCLWrapper &ocl) { ocl.setHostParticipant(true); ocl.setAdaptiveRatio(true); } },
+    };
+
+    // Native host engine as a baseline, device type is ignored
+    std::vector<BenchmarkConfig> hostConfigs = {
+        { "host_scalar", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.getHostEngine().setInstructionSet(HostInstructionSet::Scalar); } },
+        { "host_sse41", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.getHostEngine().setInstructionSet(HostInstructionSet::SSE41); } },
+        { "host", OpenCLDeviceType::CPU, [](OpenCLWrapper &) {} },
+        { "host_1_thread", OpenCLDeviceType::CPU, [](OpenCLWrapper &ocl) { ocl.getHostEngine().setThreadsCount(1); } },
+    };
+
+    std::vector<BenchmarkResult> results;
+    for (auto &config : configs)
+        RunConfig(config, platformType, sizes, warmup, repeat, results);
+    for (auto &config : hostConfigs)
+        RunConfig(config, OpenCLPlatformType::Host, sizes, warmup, repeat, results);
+
+    if (outputFile.empty())
+    {
+        WriteResults(results, format, std::cout);
+    }
+    else
+    {
+        std::ofstream out(outputFile);
+        if (!out.is_open())
+        {
+            std::cerr << "Cannot open " << outputFile << " with writing access!" << std::endl;
+            return CANNOT_OPEN_FILE;
+        }
+        WriteResults(results, format, out);
+    }
+    return 0;
+}
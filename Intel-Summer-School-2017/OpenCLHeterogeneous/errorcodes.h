@@ -13,6 +13,14 @@ enum ErrorCodes
     CANNOT_WRITE_PIXEL_TO_FILE   = 7,
     /* OpenCLWrapper errors */
     OCL_UNKNOWN_PLATFORM         = -1,
+    OCL_DEVICE_NOT_FOUND         = -2,
+    OCL_BAD_PIPELINE             = -3,
+    OCL_BAD_CONVOLUTION          = -4,
+    OCL_HOST_UNSUPPORTED         = -5,
+    OCL_STREAM_UNSUPPORTED       = -6,
+    OCL_NO_IMAGE                 = -7,
+    /* host engine errors */
+    HOST_VERIFICATION_FAILED     = -8,
 };
 
 #endif
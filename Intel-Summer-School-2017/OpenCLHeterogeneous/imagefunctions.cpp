@@ -1,87 +1,98 @@
 #include "imagefunctions.h"
 #include "errorcodes.h"
-#include <fstream>
+#include "HostImageEngine.h"
+#include <cstdio>
 #include <vector>
+#include <cstdint>
 #include <cstring>
+#include <algorithm>
 
-std::vector<unsigned char> LoadImageAsBMP(const std::string& fileName, cl_int2 &size)
+// Rows are packed into band of this size and every band is written by one call
+const size_t BMP_WRITE_BAND_SIZE = 4 * 1024 * 1024;
+// Number of entries in palette of 8-bit gray BMP
+const unsigned int GRAY_PALETTE_SIZE = 256;
+
+static HostImageEngine& GetHostEngine()
+{
+    // Engine is shared by all loads and saves, so its threads are started once
+    static HostImageEngine engine;
+    return engine;
+}
+
+cl_int2 CheckBMPHeaders(const BITMAPFILEHEADER_OWN& fileHeader, const BITMAPINFOHEADER_OWN& infoHeader, uint64_t fileLength, const std::string& fileName)
 {
     const unsigned int bit32 = 32;
-    unsigned int bytesPerPixel = 0;
-    // read whole file
-    std::ifstream image_src(fileName, std::ios_base::ate | std::ios_base::binary);
-    if (!image_src.is_open())
-        throw cl::Error(CANNOT_OPEN_FILE, std::string("Could not open " + fileName + "!").c_str());
-
-    std::streamoff file_length = image_src.tellg();
-    if (file_length == -1)
-        throw cl::Error(INV_FILE_LENGTH, std::string("Cannot determine the length of file " + fileName).c_str());
-
-    image_src.seekg(0, std::ios_base::beg);   // go to the file beginning
-    std::vector<char> input_data;
-    input_data.resize(static_cast<size_t>(file_length));
-    image_src.read(&input_data[0], file_length);
-
-    image_src.close();
-
-    // offset of the start for data
-    int data_offset = *(int*)&input_data[10];
-    // get image size
-    size = *(cl_int2*)&input_data[18];
-    // get image bits per pixel
-    cl_short bits = *(cl_short*)&input_data[28];
-
-    // calc pixel_pitch as width for 32bit images
-    int pixel_pitch = size.s[0];
-
-    if (bits != bit32)
+    const size_t bytesPerPixel = bit32 / 8;
+    if (fileHeader.bfType != 0x4D42 || infoHeader.biBitCount != bit32 || infoHeader.biWidth <= 0 || infoHeader.biHeight <= 0)
         throw cl::Error(BAD_FORMAT_BMP, std::string("Bad format of " + fileName + " BMP file. Only 32 bits per pixel is supported").c_str());
 
-    bytesPerPixel = bits / 8;
-    if (size.s[0] * size.s[1] * bytesPerPixel + data_offset > input_data.size())
+    // Size is checked in 64 bits, so huge dimensions can't overflow
+    uint64_t pixelsSize = static_cast<uint64_t>(infoHeader.biWidth) * infoHeader.biHeight * bytesPerPixel;
+    if (fileHeader.bfOffBits + pixelsSize > fileLength)
         throw cl::Error(CANNOT_READ_BMP, std::string("Could not read " + fileName + " BMP file.").c_str());
 
-    // prepare storage for pixels
-    std::vector<unsigned char> p;// = new unsigned char[size.s[1] * pixel_pitch * bytesPerPixel];
-    auto bufSize = size.s[1] * pixel_pitch * bytesPerPixel;
-    p.resize(bufSize);
-    // convert BMP ABGR pixels into RGBA and
-    // bottom-top format into top-bottom
-    for (int y = 0; y < size.s[1]; ++y)
-    {
-        for (int x = 0; x < size.s[0]; ++x)
-        {
-            unsigned char* pSrc = (unsigned char*)&input_data[data_offset + (y * size.s[0] + x) * bytesPerPixel];
-            unsigned char* pDst = &p[0] + bytesPerPixel * (y*pixel_pitch + x);
-            pDst[0] = pSrc[1];
-            pDst[1] = pSrc[2];
-            pDst[2] = pSrc[3];
-            pDst[3] = pSrc[0];
-        }
-    }
-    return p;
-};
+    cl_int2 size;
+    size.s[0] = infoHeader.biWidth;
+    size.s[1] = infoHeader.biHeight;
+    return size;
+}
 
-void SaveImageAsBMP(unsigned int* ptr, int width, int height, std::string fileName)
+MappedBMP MapImageAsBMP(const std::string& fileName)
 {
-    FILE* stream = nullptr;
-    int* ppix = (int*)ptr;
+    MappedBMP bmp;
+    bmp.file = MappedFile(fileName);
+    auto data = bmp.file.getData();
+    auto fileLength = bmp.file.getSize();
 
-    stream = fopen(fileName.c_str(), "wb");
-
-    if (stream == nullptr)
-        throw cl::Error(CANNOT_OPEN_FILE, std::string("Cannot open " + fileName + " with writing access!").c_str());
-    const unsigned int bytesPerPixel = 3;
     BITMAPFILEHEADER_OWN fileHeader;
     BITMAPINFOHEADER_OWN infoHeader;
+    if (fileLength < sizeof(fileHeader) + sizeof(infoHeader))
+        throw cl::Error(CANNOT_READ_BMP, std::string("Could not read " + fileName + " BMP file.").c_str());
+    memcpy(&fileHeader, data, sizeof(fileHeader));
+    memcpy(&infoHeader, data + sizeof(fileHeader), sizeof(infoHeader));
+
+    bmp.size = CheckBMPHeaders(fileHeader, infoHeader, fileLength, fileName);
+    bmp.pixels = data + fileHeader.bfOffBits;
+    return bmp;
+}
 
-    int alignSize = width * bytesPerPixel;
-    alignSize ^= 0x03;
-    alignSize++;
-    alignSize &= 0x03;
+void ConvertBMPToRGBA(const MappedBMP& bmp, std::vector<unsigned char>& rgba)
+{
+    size_t pixelsCount = static_cast<size_t>(bmp.size.s[0]) * bmp.size.s[1];
+    // Only size is changed, memory of the buffer is reused if it's large enough
+    rgba.resize(pixelsCount * 4);
+    ConvertBMPPixelsToRGBA(bmp.pixels, &rgba[0], pixelsCount);
+}
+
+void ConvertBMPPixelsToRGBA(const unsigned char* src, unsigned char* dst, size_t pixelsCount)
+{
+    // convert BMP ABGR pixels into RGBA with SIMD byte shuffles on all host threads
+    GetHostEngine().convertABGRToRGBA(src, dst, pixelsCount);
+}
+
+void LoadImageAsBMP(const std::string& fileName, cl_int2 &size, std::vector<unsigned char>& rgba)
+{
+    auto bmp = MapImageAsBMP(fileName);
+    ConvertBMPToRGBA(bmp, rgba);
+    size = bmp.size;
+}
 
-    int rowLength = width * bytesPerPixel + alignSize;
+std::vector<unsigned char> LoadImageAsBMP(const std::string& fileName, cl_int2 &size)
+{
+    std::vector<unsigned char> rgba;
+    LoadImageAsBMP(fileName, size, rgba);
+    return rgba;
+}
+
+/**
+Fill headers of BMP file.
 
+@param bitCount bits per pixel of the file.
+@param paletteSize number of palette entries which follow the headers.
+@param rowLength length of row in file including padding.
+*/
+static void FillBMPHeaders(BITMAPFILEHEADER_OWN& fileHeader, BITMAPINFOHEADER_OWN& infoHeader, int width, int height, unsigned int bitCount, unsigned int paletteSize, size_t rowLength)
+{
     fileHeader.bfReserved1 = 0x0000;
     fileHeader.bfReserved2 = 0x0000;
 
@@ -89,16 +100,43 @@ void SaveImageAsBMP(unsigned int* ptr, int width, int height, std::string fileNa
     infoHeader.biWidth = width;
     infoHeader.biHeight = height;
     infoHeader.biPlanes = 1;
-    infoHeader.biBitCount = 8 * bytesPerPixel;
+    infoHeader.biBitCount = bitCount;
     infoHeader.biCompression = 0L; // BI_RGB;
-    infoHeader.biSizeImage = rowLength * height;
+    infoHeader.biSizeImage = static_cast<unsigned int>(rowLength * height);
     infoHeader.biXPelsPerMeter = 0;
     infoHeader.biYPelsPerMeter = 0;
-    infoHeader.biClrUsed = 0;
+    infoHeader.biClrUsed = paletteSize;
     infoHeader.biClrImportant = 0;
     fileHeader.bfType = 0x4D42;
-    fileHeader.bfSize = sizeof(BITMAPFILEHEADER_OWN) + sizeof(BITMAPINFOHEADER_OWN) + rowLength * height;
-    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER_OWN) + sizeof(BITMAPINFOHEADER_OWN);
+    fileHeader.bfOffBits = sizeof(BITMAPFILEHEADER_OWN) + sizeof(BITMAPINFOHEADER_OWN) + paletteSize * 4;
+    fileHeader.bfSize = fileHeader.bfOffBits + infoHeader.biSizeImage;
+}
+
+// Palette entries are BGRX, entry i is gray i
+static void FillGrayPalette(unsigned char* palette)
+{
+    for (unsigned int i = 0; i < GRAY_PALETTE_SIZE; ++i)
+    {
+        palette[i * 4] = palette[i * 4 + 1] = palette[i * 4 + 2] = static_cast<unsigned char>(i);
+        palette[i * 4 + 3] = 0;
+    }
+}
+
+size_t GetBMPRowLength(int width, unsigned int bitCount)
+{
+    // Rows of BMP are aligned to 4 bytes
+    return (static_cast<size_t>(width) * (bitCount / 8) + 3) & ~static_cast<size_t>(3);
+}
+
+FILE* CreateBMPFile(const std::string& fileName, int width, int height, unsigned int bitCount)
+{
+    FILE* stream = fopen(fileName.c_str(), "wb");
+    if (stream == nullptr)
+        throw cl::Error(CANNOT_OPEN_FILE, std::string("Cannot open " + fileName + " with writing access!").c_str());
+    unsigned int paletteSize = (bitCount == 8) ? GRAY_PALETTE_SIZE : 0;
+    BITMAPFILEHEADER_OWN fileHeader;
+    BITMAPINFOHEADER_OWN infoHeader;
+    FillBMPHeaders(fileHeader, infoHeader, width, height, bitCount, paletteSize, GetBMPRowLength(width, bitCount));
 
     if (sizeof(BITMAPFILEHEADER_OWN) != fwrite(&fileHeader, 1, sizeof(BITMAPFILEHEADER_OWN), stream)) {
         fclose(stream);
@@ -110,19 +148,94 @@ void SaveImageAsBMP(unsigned int* ptr, int width, int height, std::string fileNa
         throw cl::Error(BITMAPINFOHEADER_WRITE_ERROR, std::string("Cannot write BITMAPINFOHEADER_OWN!").c_str());
     }
 
-    unsigned char buffer[bytesPerPixel];
-    for (int y = 0; y < height; ++y)
+    if (paletteSize != 0)
     {
-        for (int x = 0; x < width; ++x, ++ppix)
+        unsigned char palette[GRAY_PALETTE_SIZE * 4];
+        FillGrayPalette(palette);
+        if (sizeof(palette) != fwrite(palette, 1, sizeof(palette), stream)) {
+            fclose(stream);
+            throw cl::Error(CANNOT_WRITE_PIXEL_TO_FILE, std::string("Cannot write palette!").c_str());
+        }
+    }
+    return stream;
+}
+
+bool WriteBMPRows(FILE* stream, const unsigned char* pixels, int width, size_t rows, unsigned int bitCount)
+{
+    const size_t rowLength = GetBMPRowLength(width, bitCount);
+    const size_t pixelsRowLength = static_cast<size_t>(width) * (bitCount == 8 ? 1 : 4);
+    // Rows which need neither packing nor padding are written as is
+    if (bitCount != 24 && rowLength == pixelsRowLength)
+        return rows * rowLength == fwrite(pixels, 1, rows * rowLength, stream);
+
+    // Band buffer is kept between writes of the thread, so it's allocated once
+    static thread_local std::vector<unsigned char> band;
+    size_t bandRows = std::min(std::max<size_t>(BMP_WRITE_BAND_SIZE / rowLength, 1), rows);
+    band.resize(bandRows * rowLength);
+    for (size_t y = 0; y < rows; y += bandRows)
+    {
+        size_t count = std::min(bandRows, rows - y);
+        auto src = pixels + y * pixelsRowLength;
+        if (bitCount == 24)
+        {
+            GetHostEngine().packRowsTo24Bit(src, band.data(), width, count, rowLength);
+        }
+        else
         {
-            if (bytesPerPixel != fwrite(ppix, 1, bytesPerPixel, stream)) {
-                fclose(stream);
-                throw cl::Error(CANNOT_WRITE_PIXEL_TO_FILE, std::string("Cannot write pixel to file!").c_str());
+            for (size_t row = 0; row < count; ++row)
+            {
+                memcpy(&band[row * rowLength], src + row * pixelsRowLength, pixelsRowLength);
+                memset(&band[row * rowLength + pixelsRowLength], 0, rowLength - pixelsRowLength);
             }
         }
-        memset(buffer, 0x00, bytesPerPixel);
-        fwrite(buffer, 1, alignSize, stream);
+        if (count * rowLength != fwrite(band.data(), 1, count * rowLength, stream))
+            return false;
     }
+    return true;
+}
 
+void SaveImageAsBMP(unsigned int* ptr, int width, int height, std::string fileName, unsigned int bitCount)
+{
+    if (bitCount != 24 && bitCount != 32)
+        throw cl::Error(BAD_FORMAT_BMP, std::string("Only 24 and 32 bits per pixel are supported for " + fileName + " BMP file.").c_str());
+    FILE* stream = CreateBMPFile(fileName, width, height, bitCount);
+    bool written = WriteBMPRows(stream, reinterpret_cast<const unsigned char*>(ptr), width, height, bitCount);
     fclose(stream);
+    if (!written)
+        throw cl::Error(CANNOT_WRITE_PIXEL_TO_FILE, std::string("Cannot write pixel to file!").c_str());
+}
+
+void SaveGrayImageAsBMP(const unsigned char* ptr, int width, int height, std::string fileName)
+{
+    // Rows are written in the same order as by SaveImageAsBMP
+    FILE* stream = CreateBMPFile(fileName, width, height, 8);
+    bool written = WriteBMPRows(stream, ptr, width, height, 8);
+    fclose(stream);
+    if (!written)
+        throw cl::Error(CANNOT_WRITE_PIXEL_TO_FILE, std::string("Cannot write pixel to file!").c_str());
+}
+
+MappedOutputBMP CreateMappedBMP(const std::string& fileName, int width, int height, unsigned int bitCount)
+{
+    if (bitCount != 8 && bitCount != 32)
+        throw cl::Error(BAD_FORMAT_BMP, std::string("Only 8 and 32 bits per pixel are supported for mapped " + fileName + " BMP file.").c_str());
+    if (width <= 0 || height <= 0)
+        throw cl::Error(BAD_FORMAT_BMP, std::string("Bad size of " + fileName + " BMP file.").c_str());
+    unsigned int paletteSize = (bitCount == 8) ? GRAY_PALETTE_SIZE : 0;
+    size_t rowLength = GetBMPRowLength(width, bitCount);
+    BITMAPFILEHEADER_OWN fileHeader;
+    BITMAPINFOHEADER_OWN infoHeader;
+    FillBMPHeaders(fileHeader, infoHeader, width, height, bitCount, paletteSize, rowLength);
+
+    MappedOutputBMP bmp;
+    bmp.file = MappedFile::create(fileName, fileHeader.bfOffBits + rowLength * height);
+    auto data = bmp.file.getWritableData();
+    memcpy(data, &fileHeader, sizeof(fileHeader));
+    memcpy(data + sizeof(fileHeader), &infoHeader, sizeof(infoHeader));
+    if (paletteSize != 0)
+        FillGrayPalette(data + sizeof(fileHeader) + sizeof(infoHeader));
+    // Rows go in the same order as in memory like in SaveImageAsBMP, padding of created file is already zero
+    bmp.pixels = data + fileHeader.bfOffBits;
+    bmp.rowPitch = rowLength;
+    return bmp;
 }
@@ -4,8 +4,11 @@
 #define __CL_ENABLE_EXCEPTIONS
 
 #include <CL/cl.hpp>
+#include <cstdint>
+#include <cstdio>
 #include <string>
 #include <vector>
+#include "MappedFile.h"
 
 // Bitmap file headers and utilities
 #pragma pack (push)
@@ -33,7 +36,51 @@ typedef struct  {
 }  BITMAPINFOHEADER_OWN;
 #pragma pack(pop)
 
+// 32-bit BMP file mapped to memory, headers are validated in place and pixels aren't copied
+struct MappedBMP
+{
+    MappedFile file;
+    cl_int2 size;
+    // Pixels in file order, 4 bytes per pixel without row padding
+    const unsigned char* pixels;
+};
+
+// Validate headers of 32-bit BMP file against its length, returns size of the image
+cl_int2 CheckBMPHeaders(const BITMAPFILEHEADER_OWN& fileHeader, const BITMAPINFOHEADER_OWN& infoHeader, uint64_t fileLength, const std::string& fileName);
+MappedBMP MapImageAsBMP(const std::string& fileName);
+// Convert ABGR pixels of mapped BMP into RGBA, capacity of the caller's buffer is reused
+void ConvertBMPToRGBA(const MappedBMP& bmp, std::vector<unsigned char>& rgba);
+// Convert ABGR pixels of BMP file into RGBA, conversion can be done in place
+void ConvertBMPPixelsToRGBA(const unsigned char* src, unsigned char* dst, size_t pixelsCount);
+void LoadImageAsBMP(const std::string& fileName, cl_int2 &size, std::vector<unsigned char>& rgba);
 std::vector<unsigned char> LoadImageAsBMP(const std::string& fileName, cl_int2 &size);
-void SaveImageAsBMP(unsigned int* ptr, int width, int height, std::string fileName);
+// Length of BMP row in bytes including padding
+size_t GetBMPRowLength(int width, unsigned int bitCount);
+// Open BMP file for writing, headers and gray palette of 8-bit file are written
+FILE* CreateBMPFile(const std::string& fileName, int width, int height, unsigned int bitCount);
+/**
+Write rows of pixels to BMP file: RGBA pixels for 24-bit and 32-bit file,
+gray ones for 8-bit. Rows are packed and padded by bands, each band is
+written by one call.
+
+@return false if rows can't be written.
+*/
+bool WriteBMPRows(FILE* stream, const unsigned char* pixels, int width, size_t rows, unsigned int bitCount);
+// RGBA pixels are written as 24-bit BMP, or as 32-bit one without repacking if bitCount is 32
+void SaveImageAsBMP(unsigned int* ptr, int width, int height, std::string fileName, unsigned int bitCount = 24);
+// Gray pixels (1 byte per pixel) are written as 8-bit BMP with grayscale palette
+void SaveGrayImageAsBMP(const unsigned char* ptr, int width, int height, std::string fileName);
+
+// BMP file created in memory, pixels are written by the caller right to the file
+struct MappedOutputBMP
+{
+    MappedFile file;
+    unsigned char* pixels;
+    // Distance between rows in bytes including padding
+    size_t rowPitch;
+};
+
+// Create 32-bit BMP or 8-bit gray one with palette, headers are written and pixels are left zero
+MappedOutputBMP CreateMappedBMP(const std::string& fileName, int width, int height, unsigned int bitCount);
 
 #endif
@@ -1,23 +1,93 @@
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <cstdlib>
+#include <utility>
+#include "errorcodes.h"
 #include "imagefunctions.h"
+#include "batchprocessing.h"
 #include "OpenCLWrapper.h"
 
 const std::string in_image = "intel_orig.bmp";
 const std::string out_image = "out_intel.bmp";
+const std::string ratio_file = "ratio.txt";
+const std::string local_size_file = "local_size.txt";
 
-int main()
+/*
+Usage:
+    OpenCLHeterogeneous [options]                        - process intel_orig.bmp into out_intel.bmp
+    OpenCLHeterogeneous [options] [-o outDir] path...    - batch mode, path is a BMP file, a directory
+                                                           with BMP files or a .txt/.lst list of files
+Options:
+    --trace file.json    - export Chrome trace of all commands and host spans
+    --no-profiling       - disable profiling for low-overhead runs
+    --pipeline stages    - use fused filter pipeline instead of maskToImage, e.g.
+                           grayscale,mask,threshold=0.5,gamma=2.2,brightness_contrast=0.1:1.5
+    --convolution filter - use separable convolution instead of maskToImage,
+                           filter is gaussian=radius, box=radius or sobel
+    --statistics         - print histograms and statistics of the input image computed on devices
+    --host               - process a share of rows on host threads together with devices
+    --gray               - use only GPU device, its BW results are stored as 8-bit gray
+    --mapped-output      - read results right to the output BMP mapped to memory (32-bit or gray BMP)
+    --stream             - read, process and write the image by strips of rows with bounded host memory
+*/
+int main(int argc, char *argv[])
 {
     int errCode = 0;
+    std::vector<std::string> batchPaths;
+    std::string outputDir = ".";
+    std::string traceFile;
+    std::string pipeline;
+    std::string convolution;
+    bool statistics = false;
+    bool hostParticipant = false;
+    bool grayOutput = false;
+    bool mappedOutput = false;
+    bool streaming = false;
+    bool profiling = true;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            outputDir = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc)
+            traceFile = argv[++i];
+        else if (arg == "--pipeline" && i + 1 < argc)
+            pipeline = argv[++i];
+        else if (arg == "--convolution" && i + 1 < argc)
+            convolution = argv[++i];
+        else if (arg == "--statistics")
+            statistics = true;
+        else if (arg == "--host")
+            hostParticipant = true;
+        else if (arg == "--gray")
+            grayOutput = true;
+        else if (arg == "--mapped-output")
+            mappedOutput = true;
+        else if (arg == "--stream")
+            streaming = true;
+        else if (arg == "--no-profiling")
+            profiling = false;
+        else
+            batchPaths.push_back(arg);
+    }
 
     OpenCLWrapper ocl;
     try
     {
         auto totalTimeStart = std::chrono::high_resolution_clock::now();
-        // Get platform and get default device
-        ocl.setPlatformAndDevice(OpenCLPlatformType::Intel, OpenCLDeviceType::COMBO);
-        ocl.setRatio(0.86);
+        // Get platform and get default device, masks of devices in heterogeneous mode are colored, so gray needs one device
+        ocl.setPlatformAndDevice(OpenCLPlatformType::Intel, grayOutput ? OpenCLDeviceType::GPU : OpenCLDeviceType::COMBO);
+        // Start from the ratio tuned by previous run if it exists
+        if (!ocl.loadRatio(ratio_file))
+            ocl.setRatio(0.86);
+        ocl.setAdaptiveRatio(true);
+        ocl.setHostParticipant(hostParticipant);
+        ocl.setGrayOutput(grayOutput);
+        // Images are emulated on CPU runtimes, so CPU works with buffers
+        ocl.setBackend(OpenCLDeviceType::CPU, OpenCLBackend::Buffer);
+        ocl.setProfiling(profiling);
+        ocl.setTrace(profiling && !traceFile.empty());
         std::cout << "Using platforms: " << ocl.getPlatformName() << std::endl;
         std::cout << "Using device: " << ocl.getDeviceName() << std::endl;
 
@@ -27,39 +97,118 @@ int main()
         // Read OpenCL source from file
         ocl.getProgramSourcesFromFile("OpenCLImages.cl");
 
-        // Build program
+        // Build program, binaries are cached in the current directory
+        ocl.setProgramCacheDir(".");
         ocl.buildProgram();
         //ocl.buildProgram("-g -s OpenCLImages.cl");
 
-        // Read image
-        cl_int2 img_size;
-        auto readImageTimeStart = std::chrono::high_resolution_clock::now();
-        std::vector<unsigned char> img = LoadImageAsBMP(in_image, img_size);
-        auto readImageTimeEnd = std::chrono::high_resolution_clock::now();
-        std::cout << "Time of reading image: " << std::chrono::duration_cast<std::chrono::milliseconds>(readImageTimeEnd - readImageTimeStart).count() << " ms." << std::endl;
+        // Create kernel
+        if (!pipeline.empty())
+        {
+            ocl.createPipelineKernel(FilterPipeline::parse(pipeline));
+        }
+        else if (!convolution.empty())
+        {
+            auto separator = convolution.find('=');
+            auto filter = convolution.substr(0, separator);
+            cl_int radius = (separator == std::string::npos) ? 1 : std::atoi(convolution.c_str() + separator + 1);
+            if (filter == "gaussian")
+                ocl.createConvolutionKernel(ConvolutionType::Gaussian, radius);
+            else if (filter == "box")
+                ocl.createConvolutionKernel(ConvolutionType::Box, radius);
+            else if (filter == "sobel")
+                ocl.createConvolutionKernel(ConvolutionType::Sobel, radius);
+            else
+                throw cl::Error(OCL_BAD_CONVOLUTION, std::string("Unknown convolution " + filter + "!").c_str());
+        }
+        else
+        {
+            ocl.createKernel("maskToImage");
+        }
+        if (grayOutput && ocl.getResultBytesPerPixel() != 1)
+            std::cout << "Gray output isn't supported by the kernel or device, results are stored as RGBA" << std::endl;
+        // Local sizes tuned by previous runs are reused
+        ocl.setLocalSizeTuningFile(local_size_file);
 
-        // Create input and output images
-        ocl.createInputAndOutputImages(img, img_size);
+        if (!batchPaths.empty())
+        {
+            // Context, queues, program and kernel are reused for all images
+            std::vector<std::string> files;
+            for (auto &path : batchPaths)
+            {
+                auto pathFiles = CollectImageFiles(path);
+                files.insert(files.end(), pathFiles.begin(), pathFiles.end());
+            }
+            ProcessBatch(ocl, files, outputDir, mappedOutput);
+            ocl.saveRatio(ratio_file);
+        }
+        else if (streaming)
+        {
+            // Image is never kept in host memory as a whole
+            ProcessImageInStrips(ocl, in_image, out_image);
+            ocl.saveRatio(ratio_file);
+        }
+        else
+        {
+            // Read image
+            cl_int2 img_size;
+            auto readImageTimeStart = std::chrono::high_resolution_clock::now();
+            std::vector<unsigned char> img;
+            {
+                Tracer::Span span(ocl.getTracer(), "load");
+                LoadImageAsBMP(in_image, img_size, img);
+            }
+            auto readImageTimeEnd = std::chrono::high_resolution_clock::now();
+            std::cout << "Time of reading image: " << std::chrono::duration_cast<std::chrono::milliseconds>(readImageTimeEnd - readImageTimeStart).count() << " ms." << std::endl;
 
-        // Create kernel
-        ocl.createKernel("maskToImage");
+            // Output file is created before processing, so tiles are read right to its pixels
+            MappedOutputBMP outputBmp;
+            if (mappedOutput)
+            {
+                outputBmp = CreateMappedBMP(out_image, img_size.s[0], img_size.s[1], 8 * ocl.getResultBytesPerPixel());
+                // Rows of gray BMP are padded if width isn't multiple of 4, such results are saved as usual
+                mappedOutput = (outputBmp.rowPitch == (size_t)img_size.s[0] * ocl.getResultBytesPerPixel());
+                ocl.setResultsTarget(mappedOutput ? outputBmp.pixels : nullptr);
+            }
 
-        // Run OpenCL program
-        ocl.runKernel();
+            // Create input and output images
+            // Loaded pixels are moved to the wrapper, not copied
+            ocl.createInputAndOutputImages(std::move(img), img_size);
+            if (statistics)
+                ocl.computeStatistics().print();
 
-        // Get results
-        auto results = ocl.getResults();
-        unsigned int *p = reinterpret_cast<unsigned int *>(&results[0]);
+            // Run OpenCL program
+            ocl.runKernel();
 
-        ocl.printTimes();
+            ocl.printTimes();
+            ocl.printTilingPlan();
+            ocl.saveRatio(ratio_file);
 
-        // Write output image
-        auto writeImageTimeStart = std::chrono::high_resolution_clock::now();
-        SaveImageAsBMP(p, img_size.s[0], img_size.s[1], out_image);
-        auto writeImageTimeEnd = std::chrono::high_resolution_clock::now();
-        std::cout << "Time of writing image: " << std::chrono::duration_cast<std::chrono::milliseconds>(writeImageTimeEnd - writeImageTimeStart).count() << " ms." << std::endl;
+            // Write output image
+            auto writeImageTimeStart = std::chrono::high_resolution_clock::now();
+            {
+                Tracer::Span span(ocl.getTracer(), "save");
+                // Results read to the mapped file are written back when it's unmapped, wrapper stops using it before
+                ocl.setResultsTarget(nullptr);
+                outputBmp = MappedOutputBMP();
+                if (!mappedOutput)
+                {
+                    // Get results
+                    auto results = ocl.getResults();
+                    unsigned int *p = reinterpret_cast<unsigned int *>(&results[0]);
+                    if (ocl.getResultBytesPerPixel() == 1)
+                        SaveGrayImageAsBMP(&results[0], img_size.s[0], img_size.s[1], out_image);
+                    else
+                        SaveImageAsBMP(p, img_size.s[0], img_size.s[1], out_image);
+                }
+            }
+            auto writeImageTimeEnd = std::chrono::high_resolution_clock::now();
+            std::cout << "Time of writing image: " << std::chrono::duration_cast<std::chrono::milliseconds>(writeImageTimeEnd - writeImageTimeStart).count() << " ms." << std::endl;
+        }
 
         auto totalTimeEnd = std::chrono::high_resolution_clock::now();
+        if (!traceFile.empty())
+            ocl.exportTrace(traceFile);
         std::cout << "Total time: " << std::chrono::duration_cast<std::chrono::milliseconds>(totalTimeEnd - totalTimeStart).count() << " ms." << std::endl;
         std::cout << "Done!" << std::endl;
     }